@@ -0,0 +1,212 @@
+// Times every phase of a batch run on a generated city and prints the results as JSON.
+// Build from the repository root:
+//   g++ -std=c++17 -O2 -pthread bench/benchmark.cpp json.cpp -o benchmark
+#include "city_generator.h"
+#include "../queries.h"
+#include "../route.h"
+#include "../routemanager.h"
+#include "../json.h"
+#include "../parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+
+using namespace std;
+
+struct BenchmarkSettings {
+	Bench::CitySettings city;
+	size_t thread_count = DefaultThreadCount();
+	size_t route_cache_capacity = 0;
+	BusGraphModel bus_graph_model = BusGraphModel::DENSE;
+};
+
+// Flags: --stops=N, --buses=N, --route-length=N, --roundtrip-ratio=X, --road-distance-density=X,
+// --stat-requests=N, --seed=N, --threads=N, --route-cache=N (0, the default, disables the cache),
+// --bus-graph=dense|linear.
+BenchmarkSettings ReadBenchmarkSettings(int argc, char* argv[]) {
+	BenchmarkSettings settings;
+	auto& city = settings.city;
+	for (int i = 1; i < argc; ++i) {
+		string_view arg = argv[i];
+		const string name = Split(arg, "=");
+		const string value(arg);
+
+		if (name == "--stops") {
+			city.stop_count = max(2, ConvertInNumber<int>(value));
+		} else if (name == "--buses") {
+			city.bus_count = max(1, ConvertInNumber<int>(value));
+		} else if (name == "--route-length") {
+			city.route_length = max(2, ConvertInNumber<int>(value));
+		} else if (name == "--roundtrip-ratio") {
+			city.roundtrip_ratio = ConvertInNumber<double>(value);
+		} else if (name == "--road-distance-density") {
+			city.road_distance_density = max(0.0, ConvertInNumber<double>(value));
+		} else if (name == "--stat-requests") {
+			city.stat_request_count = max(0, ConvertInNumber<int>(value));
+		} else if (name == "--seed") {
+			city.seed = ConvertInNumber<uint64_t>(value);
+		} else if (name == "--threads") {
+			settings.thread_count = max(1, ConvertInNumber<int>(value));
+		} else if (name == "--route-cache") {
+			settings.route_cache_capacity = max(0, ConvertInNumber<int>(value));
+		} else if (name == "--bus-graph") {
+			if (const auto model = ReadBusGraphModel(value)) {
+				settings.bus_graph_model = *model;
+			} else {
+				cerr << "Unknown bus graph model: " << value << endl;
+			}
+		} else {
+			cerr << "Unknown argument: " << argv[i] << endl;
+		}
+	}
+	return settings;
+}
+
+class Stopwatch {
+public:
+	Stopwatch() : start_(chrono::steady_clock::now()) {}
+
+	double GetSeconds() const {
+		return chrono::duration<double>(chrono::steady_clock::now() - start_).count();
+	}
+
+private:
+	chrono::steady_clock::time_point start_;
+};
+
+// Peak resident set size of the process in kilobytes, or 0 where it is not known.
+long GetPeakRssKb() {
+#ifndef _WIN32
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return 0;
+#endif
+}
+
+// Latencies are in microseconds.
+void WriteLatencies(Json::Writer& out, vector<double>& latencies) {
+	sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double share) {
+		return latencies[min(latencies.size() - 1, static_cast<size_t>(share * latencies.size()))];
+	};
+
+	out.BeginObject();
+	out.Key("count").Value(static_cast<double>(latencies.size()));
+	if (!latencies.empty()) {
+		out.Key("p50_us").Value(percentile(0.5));
+		out.Key("p90_us").Value(percentile(0.9));
+		out.Key("p99_us").Value(percentile(0.99));
+		out.Key("max_us").Value(latencies.back());
+	}
+	out.EndObject();
+}
+
+int main(int argc, char* argv[]) {
+	const BenchmarkSettings settings = ReadBenchmarkSettings(argc, argv);
+	const auto& city = settings.city;
+
+	Json::Writer out(cout);
+	out.BeginObject();
+
+	out.Key("settings").BeginObject();
+	out.Key("stops").Value(static_cast<double>(city.stop_count));
+	out.Key("buses").Value(static_cast<double>(city.bus_count));
+	out.Key("route_length").Value(static_cast<double>(city.route_length));
+	out.Key("roundtrip_ratio").Value(city.roundtrip_ratio);
+	out.Key("road_distance_density").Value(city.road_distance_density);
+	out.Key("stat_requests").Value(static_cast<double>(city.stat_request_count));
+	out.Key("seed").Value(static_cast<double>(city.seed));
+	out.Key("threads").Value(static_cast<double>(settings.thread_count));
+	out.Key("route_cache").Value(static_cast<double>(settings.route_cache_capacity));
+	out.Key("bus_graph").Value(settings.bus_graph_model == BusGraphModel::LINEAR ? "linear" : "dense");
+	out.EndObject();
+
+	out.Key("phases").BeginObject();
+
+	Stopwatch generate_time;
+	const string input = Bench::GenerateCity(city);
+	out.Key("generate_s").Value(generate_time.GetSeconds());
+	out.Key("input_bytes").Value(static_cast<double>(input.size()));
+
+	DbSettings db_settings;
+	db_settings.thread_count = settings.thread_count;
+	db_settings.router_settings.thread_count = settings.thread_count;
+	db_settings.bus_graph_model = settings.bus_graph_model;
+
+	RouteManager rm;
+	rm.ConfigureRouteCache(settings.route_cache_capacity);
+
+	Stopwatch parse_time;
+	istringstream in(input);
+	Queries queries = ReadQueries(in, rm, db_settings);
+	out.Key("parse_s").Value(parse_time.GetSeconds());
+
+	// The last base request is the database update; everything before it only ingests.
+	Stopwatch ingest_time;
+	for (size_t i = 0; i + 1 < queries.base_requests.size(); ++i) {
+		queries.base_requests[i]->Run();
+	}
+	out.Key("ingest_s").Value(ingest_time.GetSeconds());
+
+	Stopwatch update_time;
+	queries.base_requests.back()->Run();
+	out.Key("update_db_s").Value(update_time.GetSeconds());
+
+	const auto& stat_requests = queries.stat_requests;
+	Stopwatch parallel_time;
+	Json::Writer responses;
+	RunStatRequests(rm, stat_requests, responses, settings.thread_count);
+	const double parallel_seconds = parallel_time.GetSeconds();
+	out.Key("stat_requests_parallel_s").Value(parallel_seconds);
+	out.Key("stat_requests_per_s").Value(parallel_seconds > 0 ? stat_requests.GetSize() / parallel_seconds : 0.0);
+	out.Key("output_bytes").Value(static_cast<double>(responses.Extract().size()));
+
+	out.EndObject();
+
+	// A second, sequential pass measures every request on its own.
+	vector<double> bus_latencies;
+	vector<double> stop_latencies;
+	vector<double> route_latencies;
+	for (size_t i = 0; i < stat_requests.GetSize(); ++i) {
+		Stopwatch request_time;
+		RunStatRequest(rm, stat_requests, i);
+		const double latency = request_time.GetSeconds() * 1e6;
+
+		const string_view type = StatRequests::GetTypeName(stat_requests.GetOrder()[i].type);
+		if (type == "Bus") {
+			bus_latencies.push_back(latency);
+		} else if (type == "Stop") {
+			stop_latencies.push_back(latency);
+		} else {
+			route_latencies.push_back(latency);
+		}
+	}
+
+	out.Key("latencies").BeginObject();
+	out.Key("Bus");
+	WriteLatencies(out, bus_latencies);
+	out.Key("Stop");
+	WriteLatencies(out, stop_latencies);
+	out.Key("Route");
+	WriteLatencies(out, route_latencies);
+	out.EndObject();
+
+	out.Key("peak_rss_kb").Value(static_cast<double>(GetPeakRssKb()));
+
+	out.EndObject();
+	out.Flush();
+	cout << endl;
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "../json.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace Bench {
+
+	struct CitySettings {
+		size_t stop_count = 1000;
+		size_t bus_count = 100;
+		// Stops a bus passes before it either closes the loop or turns back.
+		size_t route_length = 20;
+		double roundtrip_ratio = 0.5;
+		// Road distances per stop given in addition to the ones routes need.
+		double road_distance_density = 2;
+		size_t stat_request_count = 10000;
+		int bus_wait_time = 6;
+		double bus_velocity = 40;
+		uint64_t seed = 1;
+	};
+
+	struct Point {
+		double latitude;
+		double longitude;
+	};
+
+	double ComputeApproximateDistance(Point first, Point second) {
+		static const double PI = 3.1415926535;
+		static const double EARTH_RADIUS = 6'371'000;
+
+		const double latitude_delta = (second.latitude - first.latitude) * PI / 180.0;
+		const double longitude_delta = (second.longitude - first.longitude) * PI / 180.0 * cos(first.latitude * PI / 180.0);
+		return sqrt(latitude_delta * latitude_delta + longitude_delta * longitude_delta) * EARTH_RADIUS;
+	}
+
+	std::string GetStopName(size_t index) {
+		return "Stop " + std::to_string(index);
+	}
+
+	std::string GetBusName(size_t index) {
+		return "Bus " + std::to_string(index);
+	}
+
+	// Builds a whole input document. Stops are scattered over a city-sized box, buses move to one
+	// of a few random candidates closest to their current stop, and every pair of consecutive
+	// stops gets a road distance somewhat longer than the straight line in at least one direction.
+	// Consecutive stops always differ, so there must be at least two stops.
+	// The same settings always give the same text.
+	std::string GenerateCity(const CitySettings& settings) {
+		static const size_t NEXT_STOP_CANDIDATES = 8;
+		static const double MISSING_BUS_SHARE = 0.05;
+
+		std::mt19937_64 random(settings.seed);
+		std::uniform_real_distribution<double> latitude(55.55, 55.95);
+		std::uniform_real_distribution<double> longitude(37.35, 37.85);
+		std::uniform_real_distribution<double> detour(1.05, 1.6);
+		std::uniform_real_distribution<double> share(0, 1);
+		std::uniform_int_distribution<size_t> stop_index(0, settings.stop_count - 1);
+		std::uniform_int_distribution<size_t> bus_index(0, settings.bus_count - 1);
+
+		std::vector<Point> points(settings.stop_count);
+		for (auto& point : points) {
+			point = { latitude(random), longitude(random) };
+		}
+
+		std::vector<std::map<size_t, int>> road_distances(settings.stop_count);
+		auto add_road = [&](size_t from, size_t to) {
+			const double distance = ComputeApproximateDistance(points[from], points[to]) * detour(random);
+			road_distances[from][to] = std::max(1, static_cast<int>(distance));
+		};
+
+		std::vector<std::vector<size_t>> routes(settings.bus_count);
+		std::vector<bool> is_roundtrip(settings.bus_count);
+		for (size_t bus = 0; bus < settings.bus_count; ++bus) {
+			auto& route = routes[bus];
+			route.push_back(stop_index(random));
+			while (route.size() < std::max<size_t>(2, settings.route_length)) {
+				size_t next = route.back();
+				double next_distance = 0;
+				for (size_t i = 0; i < NEXT_STOP_CANDIDATES; ++i) {
+					const size_t candidate = stop_index(random);
+					const double distance = ComputeApproximateDistance(points[route.back()], points[candidate]);
+					if (candidate != route.back() && (next == route.back() || distance < next_distance)) {
+						next = candidate;
+						next_distance = distance;
+					}
+				}
+				if (next == route.back()) {
+					next = (next + 1) % settings.stop_count;
+				}
+				route.push_back(next);
+			}
+
+			// A walk that is already back at its first stop is closed as it is.
+			is_roundtrip[bus] = share(random) < settings.roundtrip_ratio;
+			if (is_roundtrip[bus] && route.back() != route.front()) {
+				route.push_back(route.front());
+			}
+
+			for (size_t i = 1; i < route.size(); ++i) {
+				const size_t from = route[i - 1];
+				const size_t to = route[i];
+				if (from != to && !road_distances[from].count(to) && !road_distances[to].count(from)) {
+					add_road(from, to);
+					if (share(random) < 0.5) {
+						add_road(to, from);
+					}
+				}
+			}
+		}
+
+		const size_t extra_road_count = static_cast<size_t>(settings.road_distance_density * settings.stop_count);
+		for (size_t i = 0; i < extra_road_count; ++i) {
+			const size_t from = stop_index(random);
+			const size_t to = stop_index(random);
+			if (from != to) {
+				add_road(from, to);
+			}
+		}
+
+		Json::Writer out(9);
+		out.BeginObject();
+
+		out.Key("routing_settings").BeginObject();
+		out.Key("bus_velocity").Value(settings.bus_velocity);
+		out.Key("bus_wait_time").Value(static_cast<double>(settings.bus_wait_time));
+		out.EndObject();
+
+		out.Key("base_requests").BeginArray();
+		for (size_t stop = 0; stop < settings.stop_count; ++stop) {
+			out.BeginObject();
+			out.Key("type").Value("Stop");
+			out.Key("name").Value(GetStopName(stop));
+			out.Key("latitude").Value(points[stop].latitude);
+			out.Key("longitude").Value(points[stop].longitude);
+			out.Key("road_distances").BeginObject();
+			for (const auto&[to, distance] : road_distances[stop]) {
+				out.Key(GetStopName(to)).Value(static_cast<double>(distance));
+			}
+			out.EndObject();
+			out.EndObject();
+		}
+		for (size_t bus = 0; bus < settings.bus_count; ++bus) {
+			out.BeginObject();
+			out.Key("type").Value("Bus");
+			out.Key("name").Value(GetBusName(bus));
+			out.Key("stops").BeginArray();
+			for (const size_t stop : routes[bus]) {
+				out.Value(GetStopName(stop));
+			}
+			out.EndArray();
+			out.Key("is_roundtrip").Value(static_cast<bool>(is_roundtrip[bus]));
+			out.EndObject();
+		}
+		out.EndArray();
+
+		// Bus, Stop and Route requests in equal shares; a few Bus requests name no bus.
+		out.Key("stat_requests").BeginArray();
+		for (size_t id = 0; id < settings.stat_request_count; ++id) {
+			out.BeginObject();
+			out.Key("id").Value(static_cast<double>(id));
+			switch (id % 3) {
+			case 0:
+				out.Key("type").Value("Bus");
+				out.Key("name").Value(share(random) < MISSING_BUS_SHARE ? std::string("Missing bus") : GetBusName(bus_index(random)));
+				break;
+			case 1:
+				out.Key("type").Value("Stop");
+				out.Key("name").Value(GetStopName(stop_index(random)));
+				break;
+			default:
+				out.Key("type").Value("Route");
+				out.Key("from").Value(GetStopName(stop_index(random)));
+				out.Key("to").Value(GetStopName(stop_index(random)));
+				break;
+			}
+			out.EndObject();
+		}
+		out.EndArray();
+
+		out.EndObject();
+		return out.Extract();
+	}
+
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+	template <typename Weight>
+	class DijkstraRouter {
+	private:
+		using Graph = DirectedWeightedGraph<Weight>;
+
+	public:
+		DijkstraRouter(const Graph& graph);
+
+		struct RouteInfo {
+			Weight weight;
+			size_t edge_count;
+		};
+
+		// Same as Router::BuildRoute, answered by a search from `from` that stops once `to` is settled.
+		std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+		class SourceTree;
+
+		// Shortest-path tree from one vertex for answering many routes from it with one search.
+		SourceTree BuildSourceTree(VertexId from) const;
+
+	private:
+		const Graph& graph_;
+
+		struct VertexState {
+			std::optional<Weight> weight;
+			std::optional<EdgeId> prev_edge;
+			bool visited = false;
+		};
+
+		using QueueItem = std::pair<Weight, VertexId>;
+
+		struct QueueItemGreater {
+			bool operator()(const QueueItem& left, const QueueItem& right) const {
+				return right.first < left.first;
+			}
+		};
+
+		// Per-query scratch space. Concurrent queries take different workspaces from the pool.
+		struct Workspace {
+			std::vector<VertexState> vertices_state;
+			std::vector<VertexId> touched_vertices;
+			// Binary min-heap kept in a vector so its capacity survives between queries.
+			std::vector<QueueItem> queue;
+
+			void Push(QueueItem item) {
+				queue.push_back(item);
+				std::push_heap(std::begin(queue), std::end(queue), QueueItemGreater{});
+			}
+
+			QueueItem Pop() {
+				std::pop_heap(std::begin(queue), std::end(queue), QueueItemGreater{});
+				const QueueItem item = queue.back();
+				queue.pop_back();
+				return item;
+			}
+
+			void Reset() {
+				for (const VertexId vertex : touched_vertices) {
+					vertices_state[vertex] = VertexState{};
+				}
+				touched_vertices.clear();
+				queue.clear();
+			}
+		};
+
+		mutable std::mutex workspaces_mutex_;
+		mutable std::vector<std::unique_ptr<Workspace>> free_workspaces_;
+
+		std::unique_ptr<Workspace> AcquireWorkspace() const {
+			{
+				std::lock_guard guard(workspaces_mutex_);
+				if (!free_workspaces_.empty()) {
+					auto workspace = std::move(free_workspaces_.back());
+					free_workspaces_.pop_back();
+					return workspace;
+				}
+			}
+			auto workspace = std::make_unique<Workspace>();
+			workspace->vertices_state.resize(graph_.GetVertexCount());
+			return workspace;
+		}
+
+		void ReleaseWorkspace(std::unique_ptr<Workspace> workspace) const {
+			workspace->Reset();
+			std::lock_guard guard(workspaces_mutex_);
+			free_workspaces_.push_back(std::move(workspace));
+		}
+
+		void StartSearch(Workspace& workspace, VertexId from) const;
+		// Settles vertices in order of distance until to is settled or nothing is left to settle.
+		void ContinueSearch(Workspace& workspace, VertexId to) const;
+		std::optional<RouteInfo> ExtractRoute(const Workspace& workspace, VertexId to, std::vector<EdgeId>& edges) const;
+
+		void RelaxEdge(Workspace& workspace, const Edge<Weight>& edge, EdgeId edge_id, const Weight& weight_from) const {
+			assert(edge.weight >= 0);
+			auto& state_to = workspace.vertices_state[edge.to];
+			if (state_to.visited) {
+				return;
+			}
+			const Weight candidate_weight = weight_from + edge.weight;
+			if (!state_to.weight || candidate_weight < *state_to.weight) {
+				if (!state_to.weight) {
+					workspace.touched_vertices.push_back(edge.to);
+				}
+				state_to.weight = candidate_weight;
+				state_to.prev_edge = edge_id;
+				workspace.Push({ candidate_weight, edge.to });
+			}
+		}
+
+	public:
+		// Grown lazily: a route to a vertex not settled yet continues the search just until it is.
+		// The tree takes its memory from the router's workspace pool and returns it when destroyed,
+		// so trees of successive origins reuse the same memory. One tree is used by one thread.
+		class SourceTree {
+		public:
+			SourceTree(const DijkstraRouter& router, VertexId from) : router_(router), from_(from),
+				workspace_(router.AcquireWorkspace())
+			{
+				router_.StartSearch(*workspace_, from_);
+			}
+
+			SourceTree(SourceTree&&) = default;
+
+			~SourceTree() {
+				if (workspace_) {
+					router_.ReleaseWorkspace(std::move(workspace_));
+				}
+			}
+
+			// Same as DijkstraRouter::BuildRoute; from must be the origin of the tree.
+			std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const {
+				assert(from == from_);
+				router_.ContinueSearch(*workspace_, to);
+				return router_.ExtractRoute(*workspace_, to, edges);
+			}
+
+		private:
+			const DijkstraRouter& router_;
+			VertexId from_;
+			// The search state is not part of the tree's value, so const routes may grow it.
+			std::unique_ptr<Workspace> workspace_;
+		};
+	};
+
+
+	template <typename Weight>
+	DijkstraRouter<Weight>::DijkstraRouter(const Graph& graph)
+		: graph_(graph)
+	{
+	}
+
+	template <typename Weight>
+	std::optional<typename DijkstraRouter<Weight>::RouteInfo> DijkstraRouter<Weight>::BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const {
+		auto workspace = AcquireWorkspace();
+		StartSearch(*workspace, from);
+		ContinueSearch(*workspace, to);
+		const auto route = ExtractRoute(*workspace, to, edges);
+		ReleaseWorkspace(std::move(workspace));
+		return route;
+	}
+
+	template <typename Weight>
+	typename DijkstraRouter<Weight>::SourceTree DijkstraRouter<Weight>::BuildSourceTree(VertexId from) const {
+		return SourceTree(*this, from);
+	}
+
+	template <typename Weight>
+	void DijkstraRouter<Weight>::StartSearch(Workspace& workspace, VertexId from) const {
+		workspace.vertices_state[from].weight = Weight(0);
+		workspace.touched_vertices.push_back(from);
+		workspace.Push({ Weight(0), from });
+	}
+
+	template <typename Weight>
+	void DijkstraRouter<Weight>::ContinueSearch(Workspace& workspace, VertexId to) const {
+		auto& vertices_state = workspace.vertices_state;
+
+		while (!vertices_state[to].visited && !workspace.queue.empty()) {
+			const auto [weight, vertex] = workspace.Pop();
+
+			auto& state = vertices_state[vertex];
+			if (state.visited) {
+				continue;
+			}
+			state.visited = true;
+
+			// Edges are relaxed even from to itself, so a later call may continue from here.
+			for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+				RelaxEdge(workspace, graph_.GetEdge(edge_id), edge_id, weight);
+			}
+		}
+	}
+
+	template <typename Weight>
+	std::optional<typename DijkstraRouter<Weight>::RouteInfo> DijkstraRouter<Weight>::ExtractRoute(const Workspace& workspace, VertexId to, std::vector<EdgeId>& edges) const {
+		edges.clear();
+		const auto& vertices_state = workspace.vertices_state;
+		const auto& state_to = vertices_state[to];
+		if (!state_to.visited) {
+			return std::nullopt;
+		}
+
+		for (std::optional<EdgeId> edge_id = state_to.prev_edge;
+			edge_id;
+			edge_id = vertices_state[graph_.GetEdge(*edge_id).from].prev_edge) {
+
+			edges.push_back(*edge_id);
+		}
+		std::reverse(std::begin(edges), std::end(edges));
+
+		return RouteInfo{ *state_to.weight, edges.size() };
+	}
+
+}
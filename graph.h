@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <deque>
+#include <iterator>
 #include <vector>
 
 template <typename It>
@@ -30,41 +31,64 @@ namespace Graph {
 		Weight weight;
 	};
 
+	// Scalar routers compare and add instead of full weights; specialize for composite weights.
+	template <typename Weight>
+	struct WeightTraits {
+		using Cost = Weight;
+
+		static Cost GetCost(const Weight& weight) {
+			return weight;
+		}
+	};
+
 	template <typename Weight>
 	class DirectedWeightedGraph {
 	private:
-		using IncidenceList = std::vector<EdgeId>;
-		using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
+		using IncidentEdgesRange = Range<const EdgeId*>;
 
 	public:
-		DirectedWeightedGraph(size_t vertex_count);
-		EdgeId AddEdge(const Edge<Weight>& edge);
+		// Incidence lists are packed into one offsets + edge ids array (CSR), so the graph
+		// can't be extended; a changed graph is built anew from its edges.
+		DirectedWeightedGraph(size_t vertex_count = 0, std::vector<Edge<Weight>> edges = {});
 
 		size_t GetVertexCount() const;
 		size_t GetEdgeCount() const;
 		const Edge<Weight>& GetEdge(EdgeId edge_id) const;
+		const std::vector<Edge<Weight>>& GetEdges() const;
 		IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
 	private:
+		size_t vertex_count_;
 		std::vector<Edge<Weight>> edges_;
-		std::vector<IncidenceList> incidence_lists_;
+		std::vector<EdgeId> incidence_offsets_;
+		std::vector<EdgeId> incidence_edges_;
 	};
 
 
 	template <typename Weight>
-	DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
-
-	template <typename Weight>
-	EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
-		edges_.push_back(edge);
-		const EdgeId id = edges_.size() - 1;
-		incidence_lists_[edge.from].push_back(id);
-		return id;
+	DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count, std::vector<Edge<Weight>> edges)
+		: vertex_count_(vertex_count),
+		edges_(std::move(edges))
+	{
+		// Counting sort by source vertex: ids within every list stay ascending.
+		incidence_offsets_.assign(vertex_count_ + 1, 0);
+		for (const auto& edge : edges_) {
+			++incidence_offsets_[edge.from + 1];
+		}
+		for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+			incidence_offsets_[vertex + 1] += incidence_offsets_[vertex];
+		}
+
+		std::vector<EdgeId> next_positions(std::begin(incidence_offsets_), std::end(incidence_offsets_) - 1);
+		incidence_edges_.resize(edges_.size());
+		for (EdgeId id = 0; id < edges_.size(); ++id) {
+			incidence_edges_[next_positions[edges_[id].from]++] = id;
+		}
 	}
 
 	template <typename Weight>
 	size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
-		return incidence_lists_.size();
+		return vertex_count_;
 	}
 
 	template <typename Weight>
@@ -77,10 +101,15 @@ namespace Graph {
 		return edges_[edge_id];
 	}
 
+	template <typename Weight>
+	const std::vector<Edge<Weight>>& DirectedWeightedGraph<Weight>::GetEdges() const {
+		return edges_;
+	}
+
 	template <typename Weight>
 	typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
 		DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
-		const auto& edges = incidence_lists_[vertex];
-		return { std::begin(edges), std::end(edges) };
+		const EdgeId* edges = incidence_edges_.data();
+		return { edges + incidence_offsets_[vertex], edges + incidence_offsets_[vertex + 1] };
 	}
 }
@@ -1,143 +1,440 @@
 #include "json.h"
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+
 using namespace std;
 
 namespace Json {
 
+	Dict::Dict(Items items) : items_(move(items)) {
+		stable_sort(items_.begin(), items_.end(), [](const value_type& lhs, const value_type& rhs) {
+			return lhs.first < rhs.first;
+		});
+		items_.erase(unique(items_.begin(), items_.end(), [](const value_type& lhs, const value_type& rhs) {
+			return lhs.first == rhs.first;
+		}), items_.end());
+	}
+
+	Dict::const_iterator Dict::find(string_view key) const {
+		auto it = lower_bound(items_.begin(), items_.end(), key, [](const value_type& item, string_view key) {
+			return item.first < key;
+		});
+		return it != items_.end() && it->first == key ? it : items_.end();
+	}
+
+	const Node& Dict::at(string_view key) const {
+		auto it = find(key);
+		if (it == end()) {
+			throw out_of_range("Json::Dict::at");
+		}
+		return it->second;
+	}
+
+	bool Dict::emplace(string_view key, Node value) {
+		auto it = lower_bound(items_.begin(), items_.end(), key, [](const value_type& item, string_view key) {
+			return item.first < key;
+		});
+		if (it != items_.end() && it->first == key) {
+			return false;
+		}
+		items_.emplace(it, key, move(value));
+		return true;
+	}
+
 	Document::Document(Node root) : root(move(root)) {
 	}
 
+	Document::Document(shared_ptr<const string> text, shared_ptr<pmr::memory_resource> arena, Node root)
+		: text(move(text)), arena(move(arena)), root(move(root)) {
+	}
+
 	const Node& Document::GetRoot() const {
 		return root;
 	}
 
-	Node LoadNode(istream& input);
+	NodeBuilder::NodeBuilder(pmr::memory_resource* resource) : resource_(resource) {
+	}
 
-	Node LoadArray(istream& input) {
-		vector<Node> result;
+	void NodeBuilder::StartArray() {
+		frames_.push_back({ false, Array(resource_), Dict::Items(resource_) });
+	}
 
-		for (char c; input >> c && c != ']'; ) {
-			if (c != ',') {
-				input.putback(c);
-			}
-			result.push_back(LoadNode(input));
-		}
+	void NodeBuilder::EndArray() {
+		Node value(move(frames_.back().array));
+		frames_.pop_back();
+		AddValue(move(value));
+	}
+
+	void NodeBuilder::StartObject() {
+		frames_.push_back({ true, Array(resource_), Dict::Items(resource_) });
+	}
+
+	void NodeBuilder::EndObject() {
+		Node value(Dict(move(frames_.back().items)));
+		frames_.pop_back();
+		AddValue(move(value));
+	}
+
+	void NodeBuilder::Key(string_view key) {
+		frames_.back().key = key;
+	}
 
-		return Node(move(result));
+	void NodeBuilder::String(string_view value) {
+		AddValue(Node(value));
 	}
 
-	Node LoadDouble(istream& input) {
-		double result = 0;
-		input >> result;
-		return Node(result);
+	void NodeBuilder::Number(double value) {
+		AddValue(Node(value));
 	}
 
-	Node LoadBool(istream& input) {
-		bool result;
-		input >> std::boolalpha >> result;
-		return Node(result);
+	void NodeBuilder::Bool(bool value) {
+		AddValue(Node(value));
 	}
 
-	Node LoadString(istream& input) {
-		string line;
-		getline(input, line, '"');
-		return Node(move(line));
+	bool NodeBuilder::IsDone() const {
+		return done_;
+	}
+
+	Node NodeBuilder::Extract() {
+		done_ = false;
+		return move(result_);
+	}
+
+	void NodeBuilder::AddValue(Node value) {
+		if (frames_.empty()) {
+			result_ = move(value);
+			done_ = true;
+		}
+		else if (frames_.back().is_object) {
+			frames_.back().items.emplace_back(frames_.back().key, move(value));
+		}
+		else {
+			frames_.back().array.push_back(move(value));
+		}
 	}
 
-	Node LoadDict(istream& input) {
-		map<string, Node> result;
+	class Parser {
+	public:
+		Parser(string_view text, Handler& handler)
+			: pos_(text.data()), end_(text.data() + text.size()), handler_(handler) {}
 
-		for (char c; input >> c && c != '}'; ) {
-			if (c == ',') {
-				input >> c;
+		void ParseNode() {
+			const char c = NextChar();
+
+			if (c == '[') {
+				ParseArray();
+			}
+			else if (c == '{') {
+				ParseDict();
+			}
+			else if (c == '"') {
+				handler_.String(ParseString());
+			}
+			else if (c == 't' || c == 'f') {
+				ParseBool(c);
+			}
+			else if (c == '\0') {
+				throw invalid_argument("Json::Parser: unexpected end of input");
+			}
+			else {
+				--pos_;
+				ParseDouble();
+			}
+		}
+
+	private:
+		const char* pos_;
+		const char* end_;
+		Handler& handler_;
+
+		void SkipSpaces() {
+			while (pos_ != end_ && isspace(static_cast<unsigned char>(*pos_))) {
+				++pos_;
 			}
+		}
 
-			string key = LoadString(input).AsString();
-			input >> c;
-			result.emplace(move(key), LoadNode(input));
+		char NextChar() {
+			SkipSpaces();
+			return pos_ != end_ ? *pos_++ : '\0';
 		}
 
-		return Node(move(result));
-	}
+		void ParseArray() {
+			handler_.StartArray();
 
-	Node LoadNode(istream& input) {
-		char c;
-		input >> c;
+			for (char c; (c = NextChar()) && c != ']'; ) {
+				if (c != ',') {
+					--pos_;
+				}
+				if (!SkipNull()) {
+					ParseNode();
+				}
+			}
 
-		if (c == '[') {
-			return LoadArray(input);
+			handler_.EndArray();
 		}
-		else if (c == '{') {
-			return LoadDict(input);
+
+		void ParseDouble() {
+			double result = 0;
+			SkipSpaces();
+			const auto [ptr, ec] = from_chars(pos_, end_, result);
+			if (ptr == pos_ || ec != errc{}) {
+				throw invalid_argument("Json::Parser: invalid value");
+			}
+			pos_ = ptr;
+			handler_.Number(result);
 		}
-		else if (c == '"') {
-			return LoadString(input);
+
+		// Handlers have no event for null, so null array items and object members are dropped.
+		bool SkipNull() {
+			static const string_view NULL_LITERAL = "null";
+			SkipSpaces();
+			if (string_view(pos_, end_ - pos_).substr(0, NULL_LITERAL.size()) != NULL_LITERAL) {
+				return false;
+			}
+			pos_ += NULL_LITERAL.size();
+			return true;
 		}
-		else if (c == 't' || c == 'f') {
-			input.putback(c);
-			return LoadBool(input);
+
+		void ParseBool(char first) {
+			const size_t rest = first == 't' ? 3 : 4;
+			pos_ = min(pos_ + rest, end_);
+			handler_.Bool(first == 't');
 		}
-		else {
-			input.putback(c);
-			return LoadDouble(input);
+
+		// Escaped characters are kept as is, the closing quote is the first unescaped one.
+		string_view ParseString() {
+			const char* begin = pos_;
+			while (pos_ != end_ && *pos_ != '"') {
+				pos_ += *pos_ == '\\' && pos_ + 1 != end_ ? 2 : 1;
+			}
+			string_view result(begin, pos_ - begin);
+			if (pos_ != end_) {
+				++pos_;
+			}
+			return result;
 		}
+
+		void ParseDict() {
+			handler_.StartObject();
+
+			for (char c; (c = NextChar()) && c != '}'; ) {
+				if (c == ',') {
+					c = NextChar();
+				}
+
+				const string_view key = ParseString();
+				NextChar();
+				if (!SkipNull()) {
+					handler_.Key(key);
+					ParseNode();
+				}
+			}
+
+			handler_.EndObject();
+		}
+	};
+
+	Writer::Writer(int precision) : precision_(precision) {
 	}
 
-	Document Load(istream& input) {
-		return Document{ LoadNode(input) };
+	Writer::Writer(ostream& out, int precision) : out_(&out), precision_(precision) {
 	}
 
-}
+	Writer::~Writer() {
+		Flush();
+	}
 
-std::ostream& operator<<(std::ostream& out, const Json::Node& node) {
-	if (std::holds_alternative<std::vector<Json::Node>>(node)) {
-		out << "[";
-		bool first = true;
-		for (const auto& n : node.AsArray()) {
-			if (first) {
-				first = !first;
+	Writer& Writer::BeginArray() {
+		BeforeValue();
+		buffer_ += '[';
+		first_in_scope_.push_back(true);
+		return *this;
+	}
+
+	Writer& Writer::EndArray() {
+		buffer_ += ']';
+		first_in_scope_.pop_back();
+		FlushIfFull();
+		return *this;
+	}
+
+	Writer& Writer::BeginObject() {
+		BeforeValue();
+		buffer_ += '{';
+		first_in_scope_.push_back(true);
+		return *this;
+	}
+
+	Writer& Writer::EndObject() {
+		buffer_ += '}';
+		first_in_scope_.pop_back();
+		FlushIfFull();
+		return *this;
+	}
+
+	Writer& Writer::Key(string_view key) {
+		BeforeValue();
+		buffer_ += '"';
+		buffer_ += key;
+		buffer_ += "\": ";
+		after_key_ = true;
+		return *this;
+	}
+
+	Writer& Writer::Value(double value) {
+		BeforeValue();
+		char chars[32];
+		const int int_part = static_cast<int>(value);
+		const auto [ptr, ec] = value == int_part
+			? to_chars(begin(chars), end(chars), int_part)
+			: to_chars(begin(chars), end(chars), value, chars_format::general, precision_);
+		buffer_.append(chars, ptr);
+		return *this;
+	}
+
+	Writer& Writer::Value(bool value) {
+		BeforeValue();
+		buffer_ += value ? "true" : "false";
+		return *this;
+	}
+
+	Writer& Writer::Value(string_view value) {
+		BeforeValue();
+		buffer_ += '"';
+		buffer_ += value;
+		buffer_ += '"';
+		return *this;
+	}
+
+	Writer& Writer::Value(const char* value) {
+		return Value(string_view(value));
+	}
+
+	Writer& Writer::Value(const string& value) {
+		return Value(string_view(value));
+	}
+
+	Writer& Writer::Value(const Node& node) {
+		if (holds_alternative<Array>(node)) {
+			BeginArray();
+			for (const auto& item : node.AsArray()) {
+				Value(item);
 			}
-			else {
-				out << ", ";
+			EndArray();
+		}
+		else if (holds_alternative<Dict>(node)) {
+			BeginObject();
+			for (const auto&[key, value] : node.AsMap()) {
+				Key(key).Value(value);
 			}
-			out << n;
+			EndObject();
+		}
+		else if (holds_alternative<bool>(node)) {
+			Value(node.AsBool());
 		}
-		out << "]";
+		else if (node.IsString()) {
+			Value(node.AsString());
+		}
+		else {
+			Value(node.AsDouble());
+		}
+		return *this;
 	}
-	if (std::holds_alternative<std::map<std::string, Json::Node>>(node)) {
-		out << "{";
-		bool first = true;
-		for (const auto&[key, value] : node.AsMap()) {
-			if (first) {
-				first = !first;
-			}
-			else {
-				out << ", ";
-			}
-			out << '"' << key << '"' << ": " << value;
+
+	Writer& Writer::RawValue(string_view json) {
+		BeforeValue();
+		buffer_ += json;
+		FlushIfFull();
+		return *this;
+	}
+
+	void Writer::Flush() {
+		if (out_) {
+			out_->write(buffer_.data(), buffer_.size());
+			buffer_.clear();
 		}
-		out << "}";
 	}
-	if (std::holds_alternative<bool>(node)) {
-		out << std::boolalpha << node.AsBool();
+
+	string Writer::Extract() {
+		string result = move(buffer_);
+		buffer_.clear();
+		return result;
 	}
-	if (std::holds_alternative<std::string>(node)) {
-		out << '"' << node.AsString() << '"';
+
+	void Writer::BeforeValue() {
+		if (after_key_) {
+			after_key_ = false;
+			return;
+		}
+		if (!first_in_scope_.empty()) {
+			if (!first_in_scope_.back()) {
+				buffer_ += ", ";
+			}
+			first_in_scope_.back() = false;
+		}
 	}
-	if (std::holds_alternative<double>(node)) {
-		double num = node.AsDouble();
-		int int_part = static_cast<int> (num);
-		if (num == int_part) {
-			out << int_part;
+
+	void Writer::FlushIfFull() {
+		static const size_t MAX_BUFFER_SIZE = 1 << 16;
+
+		if (out_ && buffer_.size() >= MAX_BUFFER_SIZE) {
+			Flush();
 		}
-		else {
-			out << num;
+	}
+
+	shared_ptr<string> ReadAll(istream& input) {
+		static const size_t CHUNK_SIZE = 1 << 20;
+
+		auto text = make_shared<string>();
+		for (;;) {
+			const size_t old_size = text->size();
+			text->resize(old_size + CHUNK_SIZE);
+			const size_t read = input.rdbuf()->sgetn(text->data() + old_size, CHUNK_SIZE);
+			text->resize(old_size + read);
+			if (read < CHUNK_SIZE) {
+				break;
+			}
 		}
+		return text;
 	}
 
+	void Parse(string_view text, Handler& handler) {
+		Parser(text, handler).ParseNode();
+	}
+
+	void Parse(istream& input, Handler& handler) {
+		const auto text = ReadAll(input);
+		Parse(*text, handler);
+	}
+
+	// The first block of the arena is as large as the text, which holds most documents whole.
+	Document LoadInArena(shared_ptr<const string> owned_text, string_view text) {
+		auto arena = make_shared<pmr::monotonic_buffer_resource>(max<size_t>(text.size(), 1));
+		NodeBuilder builder(arena.get());
+		Parse(text, builder);
+		return Document{ move(owned_text), move(arena), builder.Extract() };
+	}
+
+	Document Load(istream& input) {
+		auto text = ReadAll(input);
+		const string_view view = *text;
+		return LoadInArena(move(text), view);
+	}
+
+	Document Load(string_view text) {
+		return LoadInArena(nullptr, text);
+	}
+
+}
+
+std::ostream& operator<<(std::ostream& out, const Json::Node& node) {
+	Json::Writer(out, static_cast<int>(out.precision())).Value(node);
 	return out;
 }
 
 std::ostream& operator<<(std::ostream& out, const Json::Document& doc) {
 	return out << doc.GetRoot();
-}
\ No newline at end of file
+}
@@ -1,26 +1,64 @@
 #pragma once
 
 #include <istream>
-#include <map>
+#include <memory>
+#include <memory_resource>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
 namespace Json {
 
-	class Node : public std::variant<std::vector<Node>,
-		std::map<std::string, Node>,
+	class Node;
+
+	// Arrays and objects allocate from the memory resource they were built with, so a whole tree
+	// may live in one arena. Copies allocate from the default resource.
+	using Array = std::pmr::vector<Node>;
+
+	// Object stored as a vector of (key, value) pairs sorted by key.
+	// Keys are not owned: they point either into the parsed text or to literals.
+	class Dict {
+	public:
+		using value_type = std::pair<std::string_view, Node>;
+		using Items = std::pmr::vector<value_type>;
+		using const_iterator = Items::const_iterator;
+
+		Dict() = default;
+		explicit Dict(Items items);
+
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t size() const;
+		bool empty() const;
+
+		const_iterator find(std::string_view key) const;
+		size_t count(std::string_view key) const;
+		const Node& at(std::string_view key) const;
+
+		bool emplace(std::string_view key, Node value);
+
+	private:
+		Items items_;
+	};
+
+	// Strings are either owned (std::string) or point into the parsed text (std::string_view).
+	class Node : public std::variant<Array,
+		Dict,
 		std::string,
+		std::string_view,
 		double,
 		bool> {
 	public:
 		using variant::variant;
 
 		const auto& AsArray() const {
-			return std::get<std::vector<Node>>(*this);
+			return std::get<Array>(*this);
 		}
 		const auto& AsMap() const {
-			return std::get<std::map<std::string, Node>>(*this);
+			return std::get<Dict>(*this);
 		}
 		bool AsBool() const {
 			return std::get<bool>(*this);
@@ -28,19 +66,47 @@ namespace Json {
 		double AsDouble() const {
 			return std::get<double>(*this);
 		}
-		const auto& AsString() const {
-			return std::get<std::string>(*this);
+		std::string_view AsString() const {
+			if (const auto* str = std::get_if<std::string>(this)) {
+				return *str;
+			}
+			return std::get<std::string_view>(*this);
+		}
+		bool IsString() const {
+			return std::holds_alternative<std::string>(*this) || std::holds_alternative<std::string_view>(*this);
 		}
 		auto& GetArray() {
-			return std::get<std::vector<Node>>(*this);
+			return std::get<Array>(*this);
 		}
 	};
 
 
 
+	inline Dict::const_iterator Dict::begin() const {
+		return items_.begin();
+	}
+
+	inline Dict::const_iterator Dict::end() const {
+		return items_.end();
+	}
+
+	inline size_t Dict::size() const {
+		return items_.size();
+	}
+
+	inline bool Dict::empty() const {
+		return items_.empty();
+	}
+
+	inline size_t Dict::count(std::string_view key) const {
+		return find(key) != end();
+	}
+
 	class Document {
 	public:
 		explicit Document(Node root);
+		// root may be allocated from arena, which is then kept alive with it.
+		Document(std::shared_ptr<const std::string> text, std::shared_ptr<std::pmr::memory_resource> arena, Node root);
 
 		const Node& GetRoot() const;
 
@@ -49,10 +115,110 @@ namespace Json {
 		}
 
 	private:
+		std::shared_ptr<const std::string> text;
+		std::shared_ptr<std::pmr::memory_resource> arena;
 		Node root;
 	};
 
+	// Receives parsing events in document order. String views are valid only
+	// while the parsed text is alive.
+	class Handler {
+	public:
+		virtual ~Handler() = default;
+
+		virtual void StartArray() = 0;
+		virtual void EndArray() = 0;
+		virtual void StartObject() = 0;
+		virtual void EndObject() = 0;
+		virtual void Key(std::string_view key) = 0;
+		virtual void String(std::string_view value) = 0;
+		virtual void Number(double value) = 0;
+		virtual void Bool(bool value) = 0;
+	};
+
+	// Builds a Node from the events of exactly one value; its arrays and objects allocate from resource.
+	class NodeBuilder : public Handler {
+	public:
+		explicit NodeBuilder(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+		void StartArray() override;
+		void EndArray() override;
+		void StartObject() override;
+		void EndObject() override;
+		void Key(std::string_view key) override;
+		void String(std::string_view value) override;
+		void Number(double value) override;
+		void Bool(bool value) override;
+
+		bool IsDone() const;
+		Node Extract();
+
+	private:
+		struct Frame {
+			bool is_object;
+			Array array;
+			Dict::Items items;
+			std::string_view key;
+		};
+
+		std::pmr::memory_resource* resource_;
+		std::vector<Frame> frames_;
+		Node result_;
+		bool done_ = false;
+
+		void AddValue(Node value);
+	};
+
+	// Writes JSON straight into a buffered stream, in the same format operator<< uses.
+	// Without a stream the text stays in the buffer until Extract.
+	class Writer {
+	public:
+		explicit Writer(int precision = 6);
+		explicit Writer(std::ostream& out, int precision = 6);
+		~Writer();
+
+		Writer& BeginArray();
+		Writer& EndArray();
+		Writer& BeginObject();
+		Writer& EndObject();
+		Writer& Key(std::string_view key);
+		Writer& Value(double value);
+		Writer& Value(bool value);
+		Writer& Value(std::string_view value);
+		Writer& Value(const char* value);
+		Writer& Value(const std::string& value);
+		Writer& Value(const Node& node);
+		// Appends an already serialized value.
+		Writer& RawValue(std::string_view json);
+
+		void Flush();
+		std::string Extract();
+
+	private:
+		std::ostream* out_ = nullptr;
+		int precision_;
+		std::string buffer_;
+		std::vector<bool> first_in_scope_;
+		bool after_key_ = false;
+
+		void BeforeValue();
+		void FlushIfFull();
+	};
+
+	std::shared_ptr<std::string> ReadAll(std::istream& input);
+
+	void Parse(std::string_view text, Handler& handler);
+
+	// Streams events without building a tree; the text is read into a temporary buffer.
+	void Parse(std::istream& input, Handler& handler);
+
+	// Reads the whole stream in large chunks; strings and keys of the result point into that buffer.
+	// Documents are built in a monotonic arena freed as a whole with the document.
 	Document Load(std::istream& input);
+
+	// Parses a buffer owned by the caller (e.g. a memory-mapped file) without copying it.
+	// The buffer must outlive the document.
+	Document Load(std::string_view text);
 }
 
 std::ostream& operator<<(std::ostream& out, const Json::Node& node);
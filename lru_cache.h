@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+// Bounded map that evicts the least recently used entry. All methods may be called concurrently.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+public:
+	explicit LruCache(size_t capacity) : capacity_(capacity) {
+		index_.reserve(capacity);
+	}
+
+	std::optional<Value> Get(const Key& key) {
+		std::lock_guard guard(mutex_);
+		auto it = index_.find(key);
+		if (it == index_.end()) {
+			++misses_;
+			return std::nullopt;
+		}
+		++hits_;
+		entries_.splice(entries_.begin(), entries_, it->second);
+		return it->second->second;
+	}
+
+	void Put(const Key& key, Value value) {
+		if (capacity_ == 0) {
+			return;
+		}
+		std::lock_guard guard(mutex_);
+		auto it = index_.find(key);
+		if (it != index_.end()) {
+			it->second->second = std::move(value);
+			entries_.splice(entries_.begin(), entries_, it->second);
+			return;
+		}
+		if (entries_.size() == capacity_) {
+			index_.erase(entries_.back().first);
+			entries_.pop_back();
+		}
+		entries_.emplace_front(key, std::move(value));
+		index_.emplace(key, entries_.begin());
+	}
+
+	size_t GetCapacity() const {
+		return capacity_;
+	}
+
+	uint64_t GetHits() const {
+		return hits_;
+	}
+
+	uint64_t GetMisses() const {
+		return misses_;
+	}
+
+private:
+	using Entries = std::list<std::pair<Key, Value>>;
+
+	const size_t capacity_;
+	std::mutex mutex_;
+	Entries entries_;
+	std::unordered_map<Key, typename Entries::iterator, Hash> index_;
+
+	std::atomic<uint64_t> hits_ = 0;
+	std::atomic<uint64_t> misses_ = 0;
+};
@@ -1,193 +1,370 @@
+#include "queries.h"
 #include "route.h"
 #include "routemanager.h"
 #include "json.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "unix_socket.h"
+#include "metrics.h"
 
+#include <fstream>
 #include <iostream>
 #include <optional>
 #include <sstream>
 #include <iomanip>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 
 using namespace std;
 
-class Request {
-public:
-	Request(RouteManager& rm_ref) : rm_ref_(rm_ref) {}
-
-	virtual void Run() = 0;
-protected:
-
-	RouteManager& rm_ref_;
+struct RunSettings {
+	size_t thread_count = DefaultThreadCount();
+	string save_snapshot_path;
+	string load_snapshot_path;
+	size_t route_cache_capacity = 0;
+	bool lazy_bus_stats = false;
+	BusGraphModel bus_graph_model = BusGraphModel::DENSE;
+	bool print_route_cache_stats = false;
+	bool serve = false;
+	string socket_path;
+	size_t queue_size = 1 << 10;
+	// Stat request lines arriving within this many milliseconds of the first one are answered
+	// as one batch, so Route requests among them share searches; 0 answers every line alone.
+	size_t stat_window_ms = 0;
+	bool collect_metrics = false;
+	string metrics_path;
+	// Set in main when metrics are collected.
+	Metrics* metrics = nullptr;
 };
 
-class BaseRequest : public Request {
-public:
-	BaseRequest(RouteManager& rm_ref) : Request(rm_ref) {}
-};
-
-class InsertStopRequest : public BaseRequest {
-public:
-	InsertStopRequest(RouteManager& rm_ref, Stop stop) : BaseRequest(rm_ref),
-		stop_(move(stop)) {}
-
-	void Run() override {
-		rm_ref_.InsertStop(stop_);
-	}
-private:
-	Stop stop_;
-};
-
-class InsertBusRequest : public BaseRequest {
-public:
-	InsertBusRequest(RouteManager& rm_ref, Bus bus) : BaseRequest(rm_ref),
-		bus_(move(bus)) {}
-
-	void Run() override {
-		rm_ref_.InsertBus(bus_);
+// Flags: --threads=N, --save-snapshot=PATH, --load-snapshot=PATH,
+// --route-cache=N (0, the default, disables the cache), --route-cache-stats,
+// --lazy-bus-stats, --bus-graph=dense|linear,
+// --serve (JSON Lines on stdin), --serve-socket=PATH, --queue-size=N, --stat-window=MS,
+// --metrics[=PATH] (JSON to stderr or to the file at exit).
+RunSettings ReadRunSettings(int argc, char* argv[]) {
+	RunSettings settings;
+	for (int i = 1; i < argc; ++i) {
+		string_view arg = argv[i];
+		const string name = Split(arg, "=");
+
+		if (name == "--threads") {
+			settings.thread_count = max(1, ConvertInNumber<int>(string(arg)));
+		} else if (name == "--save-snapshot") {
+			settings.save_snapshot_path = arg;
+		} else if (name == "--load-snapshot") {
+			settings.load_snapshot_path = arg;
+		} else if (name == "--route-cache") {
+			settings.route_cache_capacity = max(0, ConvertInNumber<int>(string(arg)));
+		} else if (name == "--route-cache-stats") {
+			settings.print_route_cache_stats = true;
+		} else if (name == "--lazy-bus-stats") {
+			settings.lazy_bus_stats = true;
+		} else if (name == "--bus-graph") {
+			if (const auto model = ReadBusGraphModel(arg)) {
+				settings.bus_graph_model = *model;
+			} else {
+				cerr << "Unknown bus graph model: " << arg << endl;
+			}
+		} else if (name == "--serve") {
+			settings.serve = true;
+		} else if (name == "--serve-socket") {
+			settings.socket_path = arg;
+		} else if (name == "--queue-size") {
+			settings.queue_size = max(1, ConvertInNumber<int>(string(arg)));
+		} else if (name == "--stat-window") {
+			settings.stat_window_ms = max(0, ConvertInNumber<int>(string(arg)));
+		} else if (name == "--metrics") {
+			settings.collect_metrics = true;
+			settings.metrics_path = arg;
+		} else {
+			cerr << "Unknown argument: " << argv[i] << endl;
+		}
 	}
-private:
-	Bus bus_;
-};
+	return settings;
+}
 
-class GetSettingsRequest : public BaseRequest {
-public:
-	GetSettingsRequest(RouteManager& rm_ref, int time, double velocity) : BaseRequest(rm_ref),
-		time_(time), velocity_(velocity){}
+DbSettings MakeDbSettings(const RunSettings& settings) {
+	DbSettings db_settings;
+	db_settings.thread_count = settings.thread_count;
+	db_settings.router_settings.thread_count = settings.thread_count;
+	db_settings.lazy_bus_stats = settings.lazy_bus_stats;
+	db_settings.bus_graph_model = settings.bus_graph_model;
+	db_settings.metrics = settings.metrics;
+	return db_settings;
+}
 
-	void Run() override {
-		rm_ref_.GetRoutesSettings(time_, velocity_);
-	}
-private:
-	int time_;
-	double velocity_;
-};
+string MakeErrorResponse(const exception& error) {
+	Json::Writer out;
+	out.BeginObject();
+	out.Key("error_message").Value(error.what());
+	out.EndObject();
+	return out.Extract();
+}
 
-class StatsRequest : public Request {
+// Answers JSON Lines streams against one database. A line is either a stat request, answered
+// with one line, or a document like the batch input: its routing_settings and base_requests are
+// applied once the earlier lines are answered, then its stat_requests are answered one per line.
+// A line that is not valid JSON or misses a field is answered with an error_message.
+// With a stat window, single stat request lines are collected and answered as one batch task
+// whose response lines are passed on together.
+class Server {
 public:
-	StatsRequest(RouteManager& rm_ref, int id, Json::Document& out, string search_name = "") : Request(rm_ref),
-		id_(id),
-		out_(out),
-		search_name_(search_name) {}
-protected:
-	string search_name_;
-
-	int id_;
-	Json::Document& out_;
-};
+	Server(RouteManager& rm, const RunSettings& settings) : rm_(rm),
+		db_settings_(MakeDbSettings(settings)),
+		thread_count_(settings.thread_count),
+		queue_size_(settings.queue_size),
+		stat_window_(settings.stat_window_ms),
+		metrics_(settings.metrics) {}
+
+	void ServeStream(istream& in, OrderedPipeline::Sink sink) {
+		OrderedPipeline pipeline(thread_count_, queue_size_, move(sink));
+		auto submit = [&](shared_ptr<const StatRequests> requests) {
+			for (size_t i = 0; i < requests->GetSize(); ++i) {
+				pipeline.Submit([this, requests, i] {
+					shared_lock lock(db_mutex_);
+					return RunStatRequest(rm_, *requests, i, metrics_);
+				});
+			}
+		};
+
+		// Lines of the open window; it is submitted when its time is up, when it holds
+		// queue_size requests, before an update and at the end of the stream.
+		mutex window_mutex;
+		condition_variable window_changed;
+		shared_ptr<StatRequests> window;
+		chrono::steady_clock::time_point window_deadline;
+		bool closing = false;
+
+		auto submit_window = [&] {
+			if (!window || window->GetSize() == 0) {
+				window = nullptr;
+				return;
+			}
+			pipeline.Submit([this, requests = move(window)] {
+				shared_lock lock(db_mutex_);
+				string responses;
+				AnswerStatRequests(rm_, *requests, 1, metrics_, [&responses](const string& response) {
+					if (!responses.empty()) {
+						responses += '\n';
+					}
+					responses += response;
+				});
+				return responses;
+			});
+			window = nullptr;
+		};
+
+		thread window_timer;
+		if (stat_window_.count() > 0) {
+			window_timer = thread([&] {
+				unique_lock lock(window_mutex);
+				while (!closing) {
+					if (!window) {
+						window_changed.wait(lock);
+					} else if (window_changed.wait_until(lock, window_deadline) == cv_status::timeout) {
+						submit_window();
+					}
+				}
+			});
+		}
 
-class BusInfoRequest : public StatsRequest {
-public:
-	BusInfoRequest(RouteManager& rm_ref, int id, Json::Document& out, string search_name = "") : StatsRequest(rm_ref, id, out, search_name) {}
+		for (string line; getline(in, line); ) {
+			if (line.find_first_not_of(" \t\r") == string::npos) {
+				continue;
+			}
+			try {
+				const auto document = Json::Load(string_view(line));
+				const auto& root = document.GetRoot().AsMap();
+				if (!root.count("routing_settings") && !root.count("base_requests") && !root.count("stat_requests")) {
+					if (!window_timer.joinable()) {
+						auto requests = make_shared<StatRequests>();
+						requests->Add(root);
+						submit(move(requests));
+						continue;
+					}
+
+					lock_guard guard(window_mutex);
+					if (!window) {
+						window = make_shared<StatRequests>();
+						window_deadline = chrono::steady_clock::now() + stat_window_;
+						window_changed.notify_one();
+					}
+					window->Add(root);
+					if (window->GetSize() >= queue_size_) {
+						submit_window();
+					}
+					continue;
+				}
+
+				{
+					lock_guard guard(window_mutex);
+					submit_window();
+				}
+
+				QueriesReader reader(rm_, db_settings_);
+				Json::Parse(string_view(line), reader);
+				auto queries = reader.Extract();
+				pipeline.Wait();
+				{
+					// A line whose base requests fail leaves the database as it was before the line.
+					unique_lock lock(db_mutex_);
+					try {
+						for (auto& query : queries.base_requests) {
+							query->Run();
+						}
+					} catch (...) {
+						rm_.DiscardChanges();
+						throw;
+					}
+				}
+				submit(make_shared<StatRequests>(move(queries.stat_requests)));
+			} catch (const exception& error) {
+				// A line that cannot be handled gets an error response in its place.
+				{
+					lock_guard guard(window_mutex);
+					submit_window();
+				}
+				pipeline.Submit([response = MakeErrorResponse(error)] {
+					return response;
+				});
+			}
+		}
 
-	void Run() override {
-		rm_ref_.Bus(out_, id_, search_name_);
+		if (window_timer.joinable()) {
+			{
+				lock_guard guard(window_mutex);
+				submit_window();
+				closing = true;
+			}
+			window_changed.notify_one();
+			window_timer.join();
+		}
 	}
-};
-
-class StopInfoRequest : public  StatsRequest {
-public:
-	StopInfoRequest(RouteManager& rm_ref, int id, Json::Document& out, string search_name = "") : StatsRequest(rm_ref, id, out, search_name) {}
 
-	void Run() override {
-		rm_ref_.ViewStopBuses(out_, id_, search_name_);
+	// Every connection is a separate stream served on its own threads.
+	void ServeSocket(const string& path) {
+#ifndef _WIN32
+		UnixSocket::Listener listener(path);
+		for (;;) {
+			const int fd = listener.Accept();
+			if (fd < 0) {
+				continue;
+			}
+			thread([this, fd] {
+				UnixSocket::InputBuffer buffer(fd);
+				istream in(&buffer);
+				ServeStream(in, [fd](const string& response) {
+					UnixSocket::WriteAll(fd, response + '\n');
+				});
+				close(fd);
+			}).detach();
+		}
+#else
+		throw runtime_error("Unix sockets are not supported on this platform");
+#endif
 	}
-};
-
-class BuildRouteRequest : public  StatsRequest {
-public:
-	BuildRouteRequest(RouteManager& rm_ref, int id, Json::Document& out, string from, string to) : StatsRequest(rm_ref, id, out), from_(from), to_(to) {}
 
-	void Run() override {
-		rm_ref_.BuildRoute(out_, id_, from_, to_);
-	}
 private:
-	string from_;
-	string to_;
+	RouteManager& rm_;
+	DbSettings db_settings_;
+	size_t thread_count_;
+	size_t queue_size_;
+	chrono::milliseconds stat_window_;
+	Metrics* metrics_;
+
+	// Stat requests share the database, updates take it exclusively.
+	shared_mutex db_mutex_;
 };
 
-class UpdateQuery : public BaseRequest {
-public:
-	UpdateQuery(RouteManager& rm_ref) : BaseRequest(rm_ref) {}
-
-	void Run() override {
-		rm_ref_.UpdateDb();
+void Serve(istream& in, ostream& out, const RunSettings& settings) {
+	RouteManager rm;
+	if (!settings.load_snapshot_path.empty()) {
+		rm.LoadSnapshot(settings.load_snapshot_path);
 	}
-};
-
-vector<unique_ptr<Request>> ReadQueries(const Json::Document& in, Json::Document& out, RouteManager& rm) {
-
-	const auto& requests = in.GetRoot().AsMap();
-	const auto& routing_settings = requests.at("routing_settings").AsMap();
-	const auto& base_requests = requests.at("base_requests").AsArray();
-
-	size_t count_of_update_queries = base_requests.size();
-
-	vector <unique_ptr<Request>> result;
-	result.reserve(count_of_update_queries);
-
-	result.push_back(make_unique<GetSettingsRequest>(rm, routing_settings.at("bus_wait_time").AsDouble(),
-		routing_settings.at("bus_velocity").AsDouble()));
-
-	for (size_t i = 0; i < count_of_update_queries; ++i) {
-		const auto& request = base_requests[i].AsMap();
-		
-		const auto& type = request.at("type").AsString();
-		
-		if (type == "Stop") {
-			result.push_back(make_unique<InsertStopRequest>(rm, ReadStop(request)));
-		} else if (type == "Bus") {
-			result.push_back(make_unique<InsertBusRequest>(rm, ReadBus(request)));
-		} 
+	rm.UpdateDb(MakeDbSettings(settings));
+	rm.ConfigureRouteCache(settings.route_cache_capacity);
+
+	Server server(rm, settings);
+	if (!settings.socket_path.empty()) {
+		server.ServeSocket(settings.socket_path);
+	} else {
+		server.ServeStream(in, [&out](const string& response) {
+			out << response << '\n';
+			out.flush();
+		});
 	}
+}
 
-	result.push_back(make_unique<UpdateQuery>(rm));
-
-	const auto& stat_requests = requests.at("stat_requests").AsArray();
-
-	size_t count_of_read_queries = stat_requests.size();
+void Run(istream& in, ostream& out, const RunSettings& settings = {}) {
+	Json::Writer writer(out);
 
-	result.reserve(count_of_update_queries + count_of_read_queries);
+	RouteManager rm;
+	Queries queries;
+	{
+		Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::READ_QUERIES);
+		queries = ReadQueries(in, rm, MakeDbSettings(settings));
+	}
 	
-	for (size_t i = 0; i < count_of_read_queries; ++i) {
-		const auto& request = stat_requests[i].AsMap();
-		const auto& type = request.at("type").AsString();
-		int id = request.at("id").AsDouble();
-		
-		if (type == "Bus") {
-			const auto& name = request.at("name").AsString();
-			result.push_back(make_unique<BusInfoRequest>(rm, id, out, name));
-		} else if (type == "Stop") {
-			const auto& name = request.at("name").AsString();
-			result.push_back(make_unique<StopInfoRequest>(rm, id, out, name));
-		} else if (type == "Route") {
-			result.push_back(make_unique<BuildRouteRequest>(rm, id, out, request.at("from").AsString(), 
-																		 request.at("to").AsString()));
+	// On top of a snapshot only the stops and buses that differ from it are rebuilt.
+	{
+		Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::INGEST);
+		if (!settings.load_snapshot_path.empty()) {
+			rm.LoadSnapshot(settings.load_snapshot_path);
+		}
+		// The last base request is UpdateQuery, which reports its own phases.
+		for (size_t i = 0; i + 1 < queries.base_requests.size(); ++i) {
+			queries.base_requests[i]->Run();
 		}
 	}
+	queries.base_requests.back()->Run();
+	if (!settings.save_snapshot_path.empty()) {
+		rm.SaveSnapshot(settings.save_snapshot_path);
+	}
+	rm.ConfigureRouteCache(settings.route_cache_capacity);
+	RunStatRequests(rm, queries.stat_requests, writer, settings.thread_count, settings.metrics);
 
-	return result;
+	if (settings.print_route_cache_stats) {
+		cerr << "Route cache: " << rm.GetRouteCacheHits() << " hits, "
+			<< rm.GetRouteCacheMisses() << " misses" << endl;
+	}
 }
 
-void Run(istream& in, ostream& out) {
-	Json::Document in_doc = Json::Load(in);
-
-	vector<Json::Node> root;
-	Json::Document out_doc(root);
+void WriteMetrics(const Metrics& metrics, const string& path) {
+	ofstream file;
+	if (!path.empty()) {
+		file.open(path);
+	}
+	ostream& out = path.empty() ? cerr : file;
 
-	RouteManager rm;
-	auto queries = ReadQueries(in_doc, out_doc, rm);
-	
-	for (auto& query : queries) {
-		
-		query->Run();
+	{
+		Json::Writer writer(out);
+		metrics.Write(writer);
 	}
-	out << setprecision(6);
-	out << out_doc;
+	out << endl;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 	
-	Run(cin, cout);
+	RunSettings settings = ReadRunSettings(argc, argv);
+	optional<Metrics> metrics;
+	if (settings.collect_metrics) {
+		settings.metrics = &metrics.emplace();
+	}
+
+	if (settings.serve || !settings.socket_path.empty()) {
+		Serve(cin, cout, settings);
+	} else {
+		Run(cin, cout, settings);
+	}
+
+	if (metrics) {
+		WriteMetrics(*metrics, settings.metrics_path);
+	}
 	
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "json.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Timings and counters of one run. Everything that reports here takes a Metrics pointer
+// and does nothing, not even reading a clock, when it is null.
+class Metrics {
+public:
+	enum class Phase {
+		READ_QUERIES,
+		INGEST,
+		ROUTE_STATS,
+		GRAPH_BUILD,
+		ROUTER,
+		STAT_REQUESTS,
+		SERIALIZATION,
+		COUNT
+	};
+
+	// Latencies in nanoseconds counted in power-of-two buckets; safe to record from many threads.
+	class LatencyHistogram {
+	public:
+		void Record(uint64_t nanoseconds) {
+			++buckets_[GetBucket(nanoseconds)];
+			++count_;
+			sum_ += nanoseconds;
+			uint64_t max = max_.load(std::memory_order_relaxed);
+			while (nanoseconds > max && !max_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {}
+		}
+
+		// Percentiles are upper bounds of the buckets they fall into.
+		void Write(Json::Writer& out) const {
+			const uint64_t count = count_;
+			out.BeginObject();
+			out.Key("count").Value(static_cast<double>(count));
+			if (count > 0) {
+				out.Key("mean_us").Value(sum_ / 1e3 / count);
+				out.Key("p50_us").Value(GetPercentile(0.5) / 1e3);
+				out.Key("p90_us").Value(GetPercentile(0.9) / 1e3);
+				out.Key("p99_us").Value(GetPercentile(0.99) / 1e3);
+				out.Key("max_us").Value(max_ / 1e3);
+
+				out.Key("buckets").BeginArray();
+				for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+					if (buckets_[i] > 0) {
+						out.BeginObject();
+						out.Key("le_us").Value(GetUpperBound(i) / 1e3);
+						out.Key("count").Value(static_cast<double>(buckets_[i]));
+						out.EndObject();
+					}
+				}
+				out.EndArray();
+			}
+			out.EndObject();
+		}
+
+	private:
+		static const size_t BUCKET_COUNT = 64;
+
+		std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets_{};
+		std::atomic<uint64_t> count_ = 0;
+		std::atomic<uint64_t> sum_ = 0;
+		std::atomic<uint64_t> max_ = 0;
+
+		static size_t GetBucket(uint64_t nanoseconds) {
+			size_t bucket = 0;
+			while (nanoseconds > 1) {
+				nanoseconds >>= 1;
+				++bucket;
+			}
+			return bucket;
+		}
+
+		static double GetUpperBound(size_t bucket) {
+			return static_cast<double>(uint64_t(1) << bucket) * 2;
+		}
+
+		double GetPercentile(double share) const {
+			const double rank = share * count_;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+				seen += buckets_[i];
+				if (seen >= rank && seen > 0) {
+					return std::min(GetUpperBound(i), static_cast<double>(max_));
+				}
+			}
+			return static_cast<double>(max_);
+		}
+	};
+
+	// Adds the wall and CPU time between its construction and destruction to a phase.
+	// CPU time is that of the whole process, so it exceeds wall time for parallel phases.
+	class ScopedPhase {
+	public:
+		ScopedPhase(Metrics* metrics, Phase phase) : metrics_(metrics), phase_(phase) {
+			if (metrics_) {
+				wall_start_ = std::chrono::steady_clock::now();
+				cpu_start_ = std::clock();
+			}
+		}
+
+		ScopedPhase(const ScopedPhase&) = delete;
+		ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+		~ScopedPhase() {
+			if (metrics_) {
+				const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start_).count();
+				const double cpu = static_cast<double>(std::clock() - cpu_start_) / CLOCKS_PER_SEC;
+				metrics_->AddPhaseTime(phase_, wall, cpu);
+			}
+		}
+
+	private:
+		Metrics* metrics_;
+		Phase phase_;
+		std::chrono::steady_clock::time_point wall_start_;
+		std::clock_t cpu_start_ = 0;
+	};
+
+	void AddPhaseTime(Phase phase, double wall_seconds, double cpu_seconds) {
+		std::lock_guard guard(mutex_);
+		auto& time = phase_times_[static_cast<size_t>(phase)];
+		time.wall_seconds += wall_seconds;
+		time.cpu_seconds += cpu_seconds;
+		++time.count;
+	}
+
+	// type is the type of a stat request: "Bus", "Stop" or "Route".
+	LatencyHistogram& GetLatencies(std::string_view type) {
+		if (type == "Bus") {
+			return latencies_[0];
+		} else if (type == "Stop") {
+			return latencies_[1];
+		}
+		return latencies_[2];
+	}
+
+	// Whole Route groups answered by one RouteManager::BuildRoutes call, source tree included.
+	LatencyHistogram& GetRouteGroupLatencies() {
+		return route_group_latencies_;
+	}
+
+	void SetCounter(const std::string& name, uint64_t value) {
+		std::lock_guard guard(mutex_);
+		counters_[name] = value;
+	}
+
+	void Write(Json::Writer& out) const {
+		static const char* PHASE_NAMES[] = {
+			"read_queries", "ingest", "route_stats", "graph_build", "router", "stat_requests", "serialization"
+		};
+		static const char* REQUEST_TYPES[] = { "Bus", "Stop", "Route" };
+
+		std::lock_guard guard(mutex_);
+		out.BeginObject();
+
+		out.Key("phases").BeginObject();
+		for (size_t i = 0; i < phase_times_.size(); ++i) {
+			const auto& time = phase_times_[i];
+			out.Key(PHASE_NAMES[i]).BeginObject();
+			out.Key("wall_s").Value(time.wall_seconds);
+			out.Key("cpu_s").Value(time.cpu_seconds);
+			out.Key("count").Value(static_cast<double>(time.count));
+			out.EndObject();
+		}
+		out.EndObject();
+
+		out.Key("latencies").BeginObject();
+		for (size_t i = 0; i < latencies_.size(); ++i) {
+			out.Key(REQUEST_TYPES[i]);
+			latencies_[i].Write(out);
+		}
+		out.EndObject();
+
+		out.Key("route_group_latencies");
+		route_group_latencies_.Write(out);
+
+		out.Key("counters").BeginObject();
+		for (const auto&[name, value] : counters_) {
+			out.Key(name).Value(static_cast<double>(value));
+		}
+		out.EndObject();
+
+		out.EndObject();
+	}
+
+private:
+	struct PhaseTime {
+		double wall_seconds = 0;
+		double cpu_seconds = 0;
+		size_t count = 0;
+	};
+
+	mutable std::mutex mutex_;
+	std::array<PhaseTime, static_cast<size_t>(Phase::COUNT)> phase_times_{};
+	std::array<LatencyHistogram, 3> latencies_;
+	LatencyHistogram route_group_latencies_;
+	std::map<std::string, uint64_t> counters_;
+};
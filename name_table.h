@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using NameId = uint32_t;
+
+// Assigns dense ids to names in order of first appearance. Names are stored once;
+// views returned by GetName stay valid for the lifetime of the table.
+class NameTable {
+public:
+	NameId Intern(std::string_view name) {
+		const auto it = ids_.find(name);
+		if (it != ids_.end()) {
+			return it->second;
+		}
+		const NameId id = static_cast<NameId>(names_.size());
+		ids_.emplace(names_.emplace_back(name), id);
+		return id;
+	}
+
+	std::optional<NameId> Find(std::string_view name) const {
+		const auto it = ids_.find(name);
+		if (it == ids_.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	std::string_view GetName(NameId id) const {
+		return names_[id];
+	}
+
+	size_t GetSize() const {
+		return names_.size();
+	}
+
+	// Forgets every name interned after the first size ones; their views become invalid.
+	void Truncate(size_t size) {
+		while (names_.size() > size) {
+			ids_.erase(names_.back());
+			names_.pop_back();
+		}
+	}
+
+private:
+	std::deque<std::string> names_;
+	std::unordered_map<std::string_view, NameId> ids_;
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Calls func(i) for every i in [0, count) on up to thread_count threads, the calling one included.
+// The first exception thrown by func stops handing out indices and is rethrown once all threads are joined.
+template <typename Func>
+void ParallelFor(size_t count, size_t thread_count, Func func) {
+	thread_count = std::max<size_t>(1, std::min(thread_count, count));
+	if (thread_count == 1) {
+		for (size_t i = 0; i < count; ++i) {
+			func(i);
+		}
+		return;
+	}
+
+	std::atomic<size_t> next_index = 0;
+	std::mutex error_mutex;
+	std::exception_ptr error;
+	auto worker = [&] {
+		try {
+			for (size_t i = next_index++; i < count; i = next_index++) {
+				func(i);
+			}
+		} catch (...) {
+			next_index = count;
+			std::lock_guard guard(error_mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+	};
+
+	// Threads that can't be started leave their share to the others.
+	std::vector<std::thread> threads;
+	threads.reserve(thread_count - 1);
+	try {
+		for (size_t i = 1; i < thread_count; ++i) {
+			threads.emplace_back(worker);
+		}
+	} catch (const std::system_error&) {
+	}
+	worker();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+// Stand-in for C++20 std::barrier: the last thread to arrive calls on_completion
+// before any of the waiting threads is released.
+template <typename OnCompletion>
+class PhaseBarrier {
+public:
+	PhaseBarrier(size_t count, OnCompletion on_completion) : count_(count), on_completion_(std::move(on_completion)) {
+	}
+
+	void ArriveAndWait() {
+		std::unique_lock lock(mutex_);
+		const size_t generation = generation_;
+		if (++arrived_ == count_) {
+			Complete();
+			return;
+		}
+		released_.wait(lock, [&] { return generation_ != generation; });
+	}
+
+	// Takes a thread that will never arrive out of the count.
+	void Drop() {
+		std::lock_guard lock(mutex_);
+		if (--count_ == arrived_ && arrived_ > 0) {
+			Complete();
+		}
+	}
+
+private:
+	void Complete() {
+		on_completion_();
+		arrived_ = 0;
+		++generation_;
+		released_.notify_all();
+	}
+
+	std::mutex mutex_;
+	std::condition_variable released_;
+	size_t count_;
+	size_t arrived_ = 0;
+	size_t generation_ = 0;
+	OnCompletion on_completion_;
+};
+
+// Calls func(phase, i) for every i in [0, task_count) in each of phase_count phases, one phase after
+// another, on up to thread_count threads started once for all phases. A phase starts only after all
+// calls of the previous one have returned. The first exception thrown by func skips all calls left
+// and is rethrown once all threads are joined.
+template <typename Func>
+void ParallelPhases(size_t phase_count, size_t task_count, size_t thread_count, Func func) {
+	thread_count = std::max<size_t>(1, std::min(thread_count, task_count));
+	if (thread_count == 1) {
+		for (size_t phase = 0; phase < phase_count; ++phase) {
+			for (size_t i = 0; i < task_count; ++i) {
+				func(phase, i);
+			}
+		}
+		return;
+	}
+
+	std::atomic<size_t> next_index = 0;
+	std::atomic<bool> failed = false;
+	std::mutex error_mutex;
+	std::exception_ptr error;
+	PhaseBarrier barrier(thread_count, [&] { next_index = 0; });
+	auto worker = [&] {
+		for (size_t phase = 0; phase < phase_count; ++phase) {
+			try {
+				for (size_t i = next_index++; i < task_count && !failed; i = next_index++) {
+					func(phase, i);
+				}
+			} catch (...) {
+				failed = true;
+				std::lock_guard guard(error_mutex);
+				if (!error) {
+					error = std::current_exception();
+				}
+			}
+			barrier.ArriveAndWait();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(thread_count - 1);
+	try {
+		for (size_t i = 1; i < thread_count; ++i) {
+			threads.emplace_back(worker);
+		}
+	} catch (const std::system_error&) {
+	}
+	for (size_t i = threads.size() + 1; i < thread_count; ++i) {
+		barrier.Drop();
+	}
+	worker();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+inline size_t DefaultThreadCount() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Runs submitted tasks on a pool of threads and passes their results to sink in submission
+// order, each as soon as all earlier ones are passed. At most window tasks are queued, running
+// or waiting to be passed; Submit blocks until there is room for one more.
+class OrderedPipeline {
+public:
+	using Task = std::function<std::string()>;
+	using Sink = std::function<void(const std::string&)>;
+
+	OrderedPipeline(size_t thread_count, size_t window, Sink sink)
+		: window_(std::max<size_t>(1, window)),
+		slots_(window_),
+		sink_(std::move(sink))
+	{
+		for (size_t i = 0; i < std::max<size_t>(1, thread_count); ++i) {
+			threads_.emplace_back([this] { Work(); });
+		}
+	}
+
+	OrderedPipeline(const OrderedPipeline&) = delete;
+	OrderedPipeline& operator=(const OrderedPipeline&) = delete;
+
+	~OrderedPipeline() {
+		Wait();
+		{
+			std::lock_guard guard(mutex_);
+			stopping_ = true;
+		}
+		has_task_.notify_all();
+		for (auto& thread : threads_) {
+			thread.join();
+		}
+	}
+
+	void Submit(Task task) {
+		std::unique_lock lock(mutex_);
+		has_room_.wait(lock, [this] { return next_submit_ - next_write_ < window_; });
+		slots_[next_submit_ % window_] = { std::move(task), {}, false };
+		++next_submit_;
+		lock.unlock();
+		has_task_.notify_one();
+	}
+
+	// Returns once every submitted task has finished and its result is passed to sink.
+	void Wait() {
+		std::unique_lock lock(mutex_);
+		all_written_.wait(lock, [this] { return next_write_ == next_submit_ && !writing_; });
+	}
+
+private:
+	struct Slot {
+		Task task;
+		std::string result;
+		bool is_ready = false;
+	};
+
+	const size_t window_;
+	std::vector<Slot> slots_;
+	Sink sink_;
+
+	std::mutex mutex_;
+	std::condition_variable has_task_;
+	std::condition_variable has_room_;
+	std::condition_variable all_written_;
+	uint64_t next_submit_ = 0;
+	uint64_t next_run_ = 0;
+	uint64_t next_write_ = 0;
+	bool writing_ = false;
+	bool stopping_ = false;
+
+	std::vector<std::thread> threads_;
+
+	void Work() {
+		std::unique_lock lock(mutex_);
+		for (;;) {
+			has_task_.wait(lock, [this] { return stopping_ || next_run_ < next_submit_; });
+			if (next_run_ == next_submit_) {
+				return;
+			}
+			Slot& slot = slots_[next_run_++ % window_];
+			Task task = std::move(slot.task);
+			lock.unlock();
+			std::string result = task();
+			lock.lock();
+			slot.result = std::move(result);
+			slot.is_ready = true;
+
+			// Only one thread passes results at a time; it takes every consecutive ready one,
+			// including those that became ready while it was unlocked.
+			if (writing_) {
+				continue;
+			}
+			writing_ = true;
+			while (next_write_ < next_submit_ && slots_[next_write_ % window_].is_ready) {
+				Slot& next_slot = slots_[next_write_ % window_];
+				const std::string output = std::move(next_slot.result);
+				next_slot.is_ready = false;
+				++next_write_;
+				lock.unlock();
+				has_room_.notify_one();
+				sink_(output);
+				lock.lock();
+			}
+			writing_ = false;
+			all_written_.notify_all();
+		}
+	}
+};
@@ -0,0 +1,495 @@
+#pragma once
+
+#include "route.h"
+#include "routemanager.h"
+#include "json.h"
+#include "parallel.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Request {
+public:
+	Request(RouteManager& rm_ref) : rm_ref_(rm_ref) {}
+	virtual ~Request() = default;
+
+	virtual void Run() = 0;
+protected:
+
+	RouteManager& rm_ref_;
+};
+
+class BaseRequest : public Request {
+public:
+	BaseRequest(RouteManager& rm_ref) : Request(rm_ref) {}
+};
+
+class InsertStopRequest : public BaseRequest {
+public:
+	InsertStopRequest(RouteManager& rm_ref, Stop stop) : BaseRequest(rm_ref),
+		stop_(std::move(stop)) {}
+
+	void Run() override {
+		rm_ref_.InsertStop(stop_);
+	}
+private:
+	Stop stop_;
+};
+
+class InsertBusRequest : public BaseRequest {
+public:
+	InsertBusRequest(RouteManager& rm_ref, Bus bus) : BaseRequest(rm_ref),
+		bus_(std::move(bus)) {}
+
+	void Run() override {
+		rm_ref_.InsertBus(bus_);
+	}
+private:
+	Bus bus_;
+};
+
+class GetSettingsRequest : public BaseRequest {
+public:
+	GetSettingsRequest(RouteManager& rm_ref, int time, double velocity) : BaseRequest(rm_ref),
+		time_(time), velocity_(velocity){}
+
+	void Run() override {
+		rm_ref_.GetRoutesSettings(time_, velocity_);
+	}
+private:
+	int time_;
+	double velocity_;
+};
+
+// Stat requests of a batch, kept in one compact array per kind. Names are copied once into
+// the batch's arena; the order array gives the kind and the index in its array of every request.
+// Stat requests only read the database, so they may run concurrently once it is built.
+class StatRequests {
+public:
+	enum class Type : uint8_t {
+		BUS,
+		STOP,
+		ROUTE
+	};
+
+	struct NameRequest {
+		int id;
+		std::string_view name;
+	};
+
+	struct RouteRequest {
+		int id;
+		std::string_view from;
+		std::string_view to;
+	};
+
+	struct Ref {
+		Type type;
+		uint32_t index;
+	};
+
+	// Requests of unknown types are skipped.
+	void Add(const Json::Dict& request) {
+		const auto type = request.at("type").AsString();
+		const int id = request.at("id").AsDouble();
+
+		if (type == "Bus") {
+			buses_.push_back({ id, Store(request.at("name").AsString()) });
+			order_.push_back({ Type::BUS, static_cast<uint32_t>(buses_.size() - 1) });
+		} else if (type == "Stop") {
+			stops_.push_back({ id, Store(request.at("name").AsString()) });
+			order_.push_back({ Type::STOP, static_cast<uint32_t>(stops_.size() - 1) });
+		} else if (type == "Route") {
+			routes_.push_back({ id, Store(request.at("from").AsString()), Store(request.at("to").AsString()) });
+			order_.push_back({ Type::ROUTE, static_cast<uint32_t>(routes_.size() - 1) });
+		}
+	}
+
+	size_t GetSize() const {
+		return order_.size();
+	}
+
+	const std::vector<Ref>& GetOrder() const {
+		return order_;
+	}
+
+	const std::vector<NameRequest>& GetBuses() const {
+		return buses_;
+	}
+
+	const std::vector<NameRequest>& GetStops() const {
+		return stops_;
+	}
+
+	const std::vector<RouteRequest>& GetRoutes() const {
+		return routes_;
+	}
+
+	// Type name as in the input: "Bus", "Stop" or "Route".
+	static std::string_view GetTypeName(Type type) {
+		switch (type) {
+		case Type::BUS:
+			return "Bus";
+		case Type::STOP:
+			return "Stop";
+		default:
+			return "Route";
+		}
+	}
+
+private:
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_ = std::make_unique<std::pmr::monotonic_buffer_resource>();
+	std::vector<Ref> order_;
+	std::vector<NameRequest> buses_;
+	std::vector<NameRequest> stops_;
+	std::vector<RouteRequest> routes_;
+
+	std::string_view Store(std::string_view name) {
+		char* data = static_cast<char*>(arena_->allocate(std::max<size_t>(name.size(), 1), 1));
+		std::copy(name.begin(), name.end(), data);
+		return { data, name.size() };
+	}
+};
+
+class UpdateQuery : public BaseRequest {
+public:
+	UpdateQuery(RouteManager& rm_ref, DbSettings settings = {}) : BaseRequest(rm_ref), settings_(settings) {}
+
+	void Run() override {
+		rm_ref_.UpdateDb(settings_);
+	}
+private:
+	DbSettings settings_;
+};
+
+std::unique_ptr<Request> ReadSettingsRequest(const Json::Dict& routing_settings, RouteManager& rm) {
+	return std::make_unique<GetSettingsRequest>(rm, routing_settings.at("bus_wait_time").AsDouble(),
+		routing_settings.at("bus_velocity").AsDouble());
+}
+
+std::unique_ptr<Request> ReadBaseRequest(const Json::Dict& request, RouteManager& rm,
+	std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	const auto type = request.at("type").AsString();
+
+	if (type == "Stop") {
+		return std::make_unique<InsertStopRequest>(rm, ReadStop(request, resource));
+	} else if (type == "Bus") {
+		return std::make_unique<InsertBusRequest>(rm, ReadBus(request, resource));
+	}
+	return nullptr;
+}
+
+struct Queries {
+	// Holds the stops and buses of base_requests, so it is declared to be destroyed after them.
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+	std::vector<std::unique_ptr<Request>> base_requests;
+	StatRequests stat_requests;
+};
+
+// Turns the input document into requests while it is parsed: only one
+// element of base_requests or stat_requests is materialized as a Json::Node at a time.
+class QueriesReader : public Json::Handler {
+public:
+	QueriesReader(RouteManager& rm, const DbSettings& db_settings) : rm_(rm), db_settings_(db_settings) {}
+
+	void StartArray() override {
+		if (StartValue()) {
+			builder_.StartArray();
+		}
+		++depth_;
+	}
+
+	void EndArray() override {
+		--depth_;
+		if (building_) {
+			builder_.EndArray();
+			FinishValue();
+		}
+	}
+
+	void StartObject() override {
+		if (StartValue()) {
+			builder_.StartObject();
+		}
+		++depth_;
+	}
+
+	void EndObject() override {
+		--depth_;
+		if (building_) {
+			builder_.EndObject();
+			FinishValue();
+		}
+	}
+
+	void Key(std::string_view key) override {
+		if (building_) {
+			builder_.Key(key);
+		} else if (depth_ == 1) {
+			section_ = key;
+		}
+	}
+
+	void String(std::string_view value) override {
+		if (StartValue()) {
+			builder_.String(value);
+			FinishValue();
+		}
+	}
+
+	void Number(double value) override {
+		if (StartValue()) {
+			builder_.Number(value);
+			FinishValue();
+		}
+	}
+
+	void Bool(bool value) override {
+		if (StartValue()) {
+			builder_.Bool(value);
+			FinishValue();
+		}
+	}
+
+	Queries Extract() {
+		Queries result;
+		result.arena = std::move(arena_);
+		result.base_requests.reserve(base_requests_.size() + 2);
+
+		if (settings_request_) {
+			result.base_requests.push_back(std::move(settings_request_));
+		}
+		std::move(base_requests_.begin(), base_requests_.end(), std::back_inserter(result.base_requests));
+		result.base_requests.push_back(std::make_unique<UpdateQuery>(rm_, db_settings_));
+		result.stat_requests = std::move(stat_requests_);
+
+		return result;
+	}
+
+private:
+	static const size_t SCRATCH_SIZE = 1 << 16;
+
+	RouteManager& rm_;
+	DbSettings db_settings_;
+
+	// Each element is built in scratch memory, which is rewound once its request is made;
+	// stops and buses of the requests are allocated from arena_ and freed all at once.
+	std::vector<std::byte> scratch_buffer_ = std::vector<std::byte>(SCRATCH_SIZE);
+	std::pmr::monotonic_buffer_resource scratch_{ scratch_buffer_.data(), scratch_buffer_.size() };
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_ = std::make_unique<std::pmr::monotonic_buffer_resource>();
+	Json::NodeBuilder builder_{ &scratch_ };
+	bool building_ = false;
+	size_t depth_ = 0;
+	std::string_view section_;
+
+	std::unique_ptr<Request> settings_request_;
+	std::vector<std::unique_ptr<Request>> base_requests_;
+	StatRequests stat_requests_;
+
+	bool StartValue() {
+		if (!building_) {
+			building_ = (depth_ == 1 && section_ == "routing_settings")
+				|| (depth_ == 2 && (section_ == "base_requests" || section_ == "stat_requests"));
+		}
+		return building_;
+	}
+
+	void FinishValue() {
+		if (!builder_.IsDone()) {
+			return;
+		}
+		building_ = false;
+
+		{
+			const Json::Node node = builder_.Extract();
+			const auto& request = node.AsMap();
+			if (section_ == "routing_settings") {
+				settings_request_ = ReadSettingsRequest(request, rm_);
+			} else if (section_ == "base_requests") {
+				if (auto base_request = ReadBaseRequest(request, rm_, arena_.get())) {
+					base_requests_.push_back(std::move(base_request));
+				}
+			} else {
+				stat_requests_.Add(request);
+			}
+		}
+		scratch_.release();
+	}
+};
+
+Queries ReadQueries(std::istream& in, RouteManager& rm, const DbSettings& db_settings = {}) {
+	QueriesReader reader(rm, db_settings);
+	Json::Parse(in, reader);
+	return reader.Extract();
+}
+
+// Answers the request at position index of the input and, when metrics is set, records its latency.
+std::string RunStatRequest(const RouteManager& rm, const StatRequests& requests, size_t index, Metrics* metrics = nullptr) {
+	const auto ref = requests.GetOrder()[index];
+	const auto start = metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+	Json::Writer writer;
+	if (ref.type == StatRequests::Type::BUS) {
+		const auto& request = requests.GetBuses()[ref.index];
+		rm.Bus(writer, request.id, request.name);
+	} else if (ref.type == StatRequests::Type::STOP) {
+		const auto& request = requests.GetStops()[ref.index];
+		rm.ViewStopBuses(writer, request.id, request.name);
+	} else {
+		const auto& request = requests.GetRoutes()[ref.index];
+		rm.BuildRoute(writer, request.id, request.from, request.to);
+	}
+
+	if (metrics) {
+		const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		metrics->GetLatencies(StatRequests::GetTypeName(ref.type)).Record(latency.count());
+	}
+	return writer.Extract();
+}
+
+// Requests are answered in chunks. Within a chunk every kind is answered from its own array
+// and Route requests are grouped by origin, so a group is answered by one BuildRoutes call,
+// which times each of its routes; the group's own time is a separate latency. Responses are
+// then passed to write_response in input order.
+template <typename ResponseWriter>
+void AnswerStatRequests(const RouteManager& rm, const StatRequests& requests, size_t thread_count, Metrics* metrics,
+	ResponseWriter write_response) {
+	static const size_t CHUNK_SIZE = 1 << 16;
+
+	const auto& order = requests.GetOrder();
+	const auto& buses = requests.GetBuses();
+	const auto& stops = requests.GetStops();
+	const auto& routes = requests.GetRoutes();
+
+	std::vector<std::string> bus_responses;
+	std::vector<std::string> stop_responses;
+	std::vector<std::string> route_responses;
+	std::vector<uint32_t> route_indices;
+	std::vector<RouteTarget> route_targets;
+	std::vector<std::string> grouped_responses;
+	std::vector<size_t> group_begins;
+
+	size_t bus_begin = 0;
+	size_t stop_begin = 0;
+	size_t route_begin = 0;
+	for (size_t chunk_begin = 0; chunk_begin < order.size(); chunk_begin += CHUNK_SIZE) {
+		const size_t chunk_end = std::min(order.size(), chunk_begin + CHUNK_SIZE);
+
+		// Every kind keeps input order in its array, so a chunk covers a range of each array.
+		size_t bus_count = 0;
+		size_t stop_count = 0;
+		size_t route_count = 0;
+		for (size_t i = chunk_begin; i < chunk_end; ++i) {
+			const auto type = order[i].type;
+			bus_count += type == StatRequests::Type::BUS;
+			stop_count += type == StatRequests::Type::STOP;
+			route_count += type == StatRequests::Type::ROUTE;
+		}
+		bus_responses.resize(bus_count);
+		stop_responses.resize(stop_count);
+		route_responses.resize(route_count);
+
+		{
+			Metrics::ScopedPhase phase(metrics, Metrics::Phase::STAT_REQUESTS);
+
+			route_indices.resize(route_count);
+			for (size_t i = 0; i < route_count; ++i) {
+				route_indices[i] = static_cast<uint32_t>(route_begin + i);
+			}
+			std::stable_sort(route_indices.begin(), route_indices.end(), [&routes](uint32_t lhs, uint32_t rhs) {
+				return routes[lhs].from < routes[rhs].from;
+			});
+			route_targets.clear();
+			group_begins.clear();
+			for (size_t i = 0; i < route_count; ++i) {
+				const auto& request = routes[route_indices[i]];
+				if (i == 0 || request.from != routes[route_indices[i - 1]].from) {
+					group_begins.push_back(i);
+				}
+				route_targets.push_back({ request.id, request.to });
+			}
+			const size_t group_count = group_begins.size();
+			group_begins.push_back(route_count);
+			grouped_responses.resize(route_count);
+
+			ParallelFor(bus_count + stop_count + group_count, thread_count, [&](size_t task) {
+				const auto start = metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+				Json::Writer writer;
+				StatRequests::Type type;
+
+				if (task < bus_count) {
+					type = StatRequests::Type::BUS;
+					const auto& request = buses[bus_begin + task];
+					rm.Bus(writer, request.id, request.name);
+					bus_responses[task] = writer.Extract();
+				} else if (task < bus_count + stop_count) {
+					type = StatRequests::Type::STOP;
+					const auto& request = stops[stop_begin + task - bus_count];
+					rm.ViewStopBuses(writer, request.id, request.name);
+					stop_responses[task - bus_count] = writer.Extract();
+				} else {
+					type = StatRequests::Type::ROUTE;
+					const size_t group = task - bus_count - stop_count;
+					const size_t begin = group_begins[group];
+					rm.BuildRoutes(routes[route_indices[begin]].from, route_targets.data() + begin, group_begins[group + 1] - begin,
+						grouped_responses.data() + begin, metrics);
+				}
+
+				if (metrics) {
+					const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+					auto& latencies = type == StatRequests::Type::ROUTE
+						? metrics->GetRouteGroupLatencies()
+						: metrics->GetLatencies(StatRequests::GetTypeName(type));
+					latencies.Record(elapsed.count());
+				}
+			});
+
+			for (size_t i = 0; i < route_count; ++i) {
+				route_responses[route_indices[i] - route_begin] = std::move(grouped_responses[i]);
+			}
+		}
+
+		Metrics::ScopedPhase phase(metrics, Metrics::Phase::SERIALIZATION);
+		size_t next_bus = 0;
+		size_t next_stop = 0;
+		size_t next_route = 0;
+		for (size_t i = chunk_begin; i < chunk_end; ++i) {
+			switch (order[i].type) {
+			case StatRequests::Type::BUS:
+				write_response(bus_responses[next_bus++]);
+				break;
+			case StatRequests::Type::STOP:
+				write_response(stop_responses[next_stop++]);
+				break;
+			default:
+				write_response(route_responses[next_route++]);
+				break;
+			}
+		}
+
+		bus_begin += bus_count;
+		stop_begin += stop_count;
+		route_begin += route_count;
+	}
+}
+
+void RunStatRequests(const RouteManager& rm, const StatRequests& requests, Json::Writer& out, size_t thread_count, Metrics* metrics = nullptr) {
+	out.BeginArray();
+	AnswerStatRequests(rm, requests, thread_count, metrics, [&out](const std::string& response) {
+		out.RawValue(response);
+	});
+
+	Metrics::ScopedPhase phase(metrics, Metrics::Phase::SERIALIZATION);
+	out.EndArray();
+	out.Flush();
+}
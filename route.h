@@ -1,27 +1,54 @@
 #pragma once
 #include "json.h"
+#include "name_table.h"
 
 #include <string_view>
 #include <string>
 #include <vector>
 #include <set>
+#include <stdexcept>
+#include <algorithm>
+#include <optional>
 #include <cmath>
 #include <unordered_map>
 #include <iostream>
 #include <sstream>
 #include <cstdint>
 #include <map>
+#include <memory_resource>
 
 
+// Ingest structs allocate from the resource they are read with, see ReadStop and ReadBus.
 struct Stop {
-	std::string name;
+	std::pmr::string name;
 	double latitude;
 	double longitude;
 
-	using StopsDistance = std::unordered_map<std::string, int>;
+	using StopsDistance = std::pmr::vector<std::pair<std::pmr::string, int>>;
 	StopsDistance other_stops_distance;
 };
 
+struct RoadDistance {
+	NameId to;
+	int distance;
+};
+
+bool operator==(const RoadDistance& lhs, const RoadDistance& rhs) {
+	return lhs.to == rhs.to && lhs.distance == rhs.distance;
+}
+
+// Stop as kept after ingest: other stops are referred to by their ids in the stop name table.
+struct StopInfo {
+	double latitude = 0;
+	double longitude = 0;
+	// Sorted by stop id.
+	std::vector<RoadDistance> road_distances;
+};
+
+bool operator==(const StopInfo& lhs, const StopInfo& rhs) {
+	return lhs.latitude == rhs.latitude && lhs.longitude == rhs.longitude && lhs.road_distances == rhs.road_distances;
+}
+
 template<typename T>
 T ConvertInNumber(const std::string& str) {
 	std::istringstream to_double(str);
@@ -42,77 +69,189 @@ std::string Split(std::string_view& sv, const std::string& symbols) {
 	return result;
 }
 
-Stop ReadStop(const std::map<std::string, Json::Node>& json_stop) {
-	Stop stop;
+Stop ReadStop(const Json::Dict& json_stop, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	Stop stop{ std::pmr::string(resource), 0, 0, Stop::StopsDistance(resource) };
 
 	stop.name = json_stop.at("name").AsString();
 	stop.latitude = json_stop.at("latitude").AsDouble();
 	stop.longitude = json_stop.at("longitude").AsDouble();
 
 	const auto& road_distances = json_stop.at("road_distances").AsMap();
+	stop.other_stops_distance.reserve(road_distances.size());
 
 	for (const auto&[stop_name, distance_node] : road_distances) {
-		stop.other_stops_distance[stop_name] = distance_node.AsDouble();
+		stop.other_stops_distance.emplace_back(stop_name, distance_node.AsDouble());
 	}
 
 	return stop;
 }
 
-int ComputeRouteDistance(const Stop& first, const Stop& second) {
-	const auto& stops_distance_first = first.other_stops_distance;
-	const auto& stops_distance_second = second.other_stops_distance;
+// Road distances of all stops resolved into one adjacency array indexed by stop id.
+// A distance given only for the opposite direction is stored for both directions.
+class RoadDistanceTable {
+public:
+	RoadDistanceTable() = default;
 
-	return stops_distance_first.find(second.name) == stops_distance_first.end()
-		? stops_distance_second.at(first.name)
-		: stops_distance_first.at(second.name);
-}
+	explicit RoadDistanceTable(const std::vector<StopInfo>& stops) : offsets_(stops.size() + 1, 0) {
+		for (NameId from = 0; from < stops.size(); ++from) {
+			for (const auto& road : stops[from].road_distances) {
+				++offsets_[from + 1];
+				++offsets_[road.to + 1];
+			}
+		}
+		for (size_t i = 1; i < offsets_.size(); ++i) {
+			offsets_[i] += offsets_[i - 1];
+		}
 
-class Route {
-public:
-	using Stops = std::vector<const Stop*>;
-protected:
+		// Direct distances come first in every row, so they win over reversed ones below.
+		std::vector<size_t> row_sizes(stops.size(), 0);
+		distances_.resize(offsets_.back());
+		for (NameId from = 0; from < stops.size(); ++from) {
+			for (const auto& road : stops[from].road_distances) {
+				distances_[offsets_[from] + row_sizes[from]++] = road;
+			}
+		}
+		for (NameId from = 0; from < stops.size(); ++from) {
+			for (const auto& road : stops[from].road_distances) {
+				distances_[offsets_[road.to] + row_sizes[road.to]++] = { from, road.distance };
+			}
+		}
 
-	Stops stops_;
-	std::set<std::string_view> unique_stops_;
-	int route_lenght_ = 0;
-	double curvature_ = 0;
+		size_t size = 0;
+		for (NameId from = 0; from < stops.size(); ++from) {
+			const auto row_begin = distances_.begin() + offsets_[from];
+			const auto row_end = distances_.begin() + offsets_[from + 1];
+			std::stable_sort(row_begin, row_end, [](const RoadDistance& lhs, const RoadDistance& rhs) {
+				return lhs.to < rhs.to;
+			});
+			const auto unique_end = std::unique(row_begin, row_end, [](const RoadDistance& lhs, const RoadDistance& rhs) {
+				return lhs.to == rhs.to;
+			});
+			offsets_[from] = size;
+			size = std::move(row_begin, unique_end, distances_.begin() + size) - distances_.begin();
+		}
+		offsets_.back() = size;
+		distances_.resize(size);
+		distances_.shrink_to_fit();
+	}
+
+	int Get(NameId from, NameId to) const {
+		const auto distance = Find(from, to);
+		if (!distance) {
+			throw std::out_of_range("RoadDistanceTable::Get");
+		}
+		return *distance;
+	}
+
+	std::optional<int> Find(NameId from, NameId to) const {
+		if (from + 1 >= offsets_.size()) {
+			return std::nullopt;
+		}
+		const auto row_begin = distances_.begin() + offsets_[from];
+		const auto row_end = distances_.begin() + offsets_[from + 1];
+		const auto it = std::lower_bound(row_begin, row_end, to, [](const RoadDistance& item, NameId to) {
+			return item.to < to;
+		});
+		if (it == row_end || it->to != to) {
+			return std::nullopt;
+		}
+		return it->distance;
+	}
+
+private:
+	std::vector<size_t> offsets_;
+	std::vector<RoadDistance> distances_;
+};
 
-	static std::pair<double, double> ConvertCoordToRadian(const Stop& stop) {
+// Trigonometry of every stop computed once, so that geo distances don't recompute it per segment.
+class StopCoordinates {
+public:
+	explicit StopCoordinates(const std::vector<StopInfo>& stops) {
 		static const double PI = 3.1415926535;
 
-		return { stop.latitude * PI / 180.0, stop.longitude * PI / 180.0 };
+		sin_latitude_.reserve(stops.size());
+		cos_latitude_.reserve(stops.size());
+		longitude_.reserve(stops.size());
+		for (const auto& stop : stops) {
+			const double latitude = stop.latitude * PI / 180.0;
+			sin_latitude_.push_back(sin(latitude));
+			cos_latitude_.push_back(cos(latitude));
+			longitude_.push_back(stop.longitude * PI / 180.0);
+		}
 	}
 
-	static double ComputeGeoDistance(const Stop& first, const Stop& second) {
+	// Great-circle distance between stops from[i] and to[i] for every i in [0, count).
+	// With the latitude terms cached, each distance costs one cos and one acos.
+	void ComputeGeoDistances(const NameId* from, const NameId* to, size_t count, double* distances) const {
 		static const uint32_t EARTH_RADIUS = 6'371'000;
 
-		auto first_in_rad = ConvertCoordToRadian(first);
-		auto second_in_rad = ConvertCoordToRadian(second);
+		for (size_t i = 0; i < count; ++i) {
+			const NameId first = from[i];
+			const NameId second = to[i];
+			distances[i] = acos(sin_latitude_[first] * sin_latitude_[second] +
+				cos_latitude_[first] * cos_latitude_[second] * cos(longitude_[first] - longitude_[second])) * EARTH_RADIUS;
+		}
+	}
 
-		double angle = acos(sin(first_in_rad.first) * sin(second_in_rad.first) +
-			cos(first_in_rad.first) * cos(second_in_rad.first) * cos(first_in_rad.second - second_in_rad.second));
+private:
+	std::vector<double> sin_latitude_;
+	std::vector<double> cos_latitude_;
+	std::vector<double> longitude_;
+};
 
-		return angle * EARTH_RADIUS;
-	}
+class Route {
+public:
+	using Stops = std::vector<NameId>;
+protected:
+
+	Stops stops_;
+	// Road distance from the first stop to every stop of the route.
+	std::vector<int> distance_prefix_;
+	size_t unique_stop_count_ = 0;
+	int route_lenght_ = 0;
+	mutable double curvature_ = 0;
 
 public:
 	
-	Route(Stops& stops) : stops_(std::move(stops)) {
-		for (auto stop : stops_) {
-			unique_stops_.insert(stop->name);
+	Route() = default;
+
+	explicit Route(Stops stops) : stops_(std::move(stops)) {
+		Stops unique_stops = stops_;
+		std::sort(unique_stops.begin(), unique_stops.end());
+		unique_stop_count_ = std::unique(unique_stops.begin(), unique_stops.end()) - unique_stops.begin();
+	}
+
+	// Fills the route length and the prefix sums bus edges are built from. A route without
+	// stops has no segments and length 0.
+	void ComputeLenght(const RoadDistanceTable& distances) {
+		distance_prefix_.assign(stops_.size(), 0);
+		for (size_t i = 0; i + 1 < stops_.size(); ++i) {
+			distance_prefix_[i + 1] = distance_prefix_[i] + distances.Get(stops_[i], stops_[i + 1]);
 		}
+		route_lenght_ = distance_prefix_.empty() ? 0 : distance_prefix_.back();
 	}
 
-	void ComputeLenghtAndCurvature() {
+	// geo_distances holds the great-circle length of every segment of the route, in order.
+	// Curvature is only a cached value, so it may be filled in later on a const route.
+	void ComputeCurvature(const double* geo_distances) const {
 		double route_geolenght = 0;
 
-		for (size_t i = 0; i < stops_.size() - 1; ++i) {
-			route_lenght_ += ComputeRouteDistance(*stops_[i], *stops_[i + 1]);
-
-			route_geolenght += ComputeGeoDistance(*stops_[i], *stops_[i + 1]);
+		for (size_t i = 0; i + 1 < stops_.size(); ++i) {
+			route_geolenght += geo_distances[i];
 		}
 
-		curvature_ = route_lenght_ / route_geolenght;
+		// A route without segments has nothing to compare, so its curvature stays 0.
+		curvature_ = route_geolenght > 0 ? route_lenght_ / route_geolenght : 0;
+	}
+
+	// Road distance between the stops at two positions of the route, available after ComputeLenght.
+	int GetDistance(size_t from_index, size_t to_index) const {
+		return distance_prefix_[to_index] - distance_prefix_[from_index];
+	}
+
+	void SetLenghtAndCurvature(int route_lenght, double curvature) {
+		route_lenght_ = route_lenght;
+		curvature_ = curvature;
 	}
 
 	size_t CountOfStops() const {
@@ -120,7 +259,11 @@ public:
 	}
 
 	size_t CountOfUniqueStops() const {
-		return unique_stops_.size();
+		return unique_stop_count_;
+	}
+
+	const Stops& GetStops() const {
+		return stops_;
 	}
 
 	int GetLenght() const {
@@ -3,6 +3,12 @@
 #include "route.h"
 #include "graph.h"
 #include "router.h"
+#include "dijkstra_router.h"
+#include "snapshot.h"
+#include "lru_cache.h"
+#include "name_table.h"
+#include "parallel.h"
+#include "metrics.h"
 
 #include <unordered_map>
 #include <memory>
@@ -11,23 +17,83 @@
 #include <algorithm>
 #include <iterator>
 #include <optional>
+#include <string_view>
+#include <variant>
+#include <cstdint>
+#include <type_traits>
+#include <limits>
+#include <mutex>
+#include <memory_resource>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+enum class RouterMode {
+	AUTO,
+	PRECOMPUTED,
+	ON_DEMAND
+};
+
+enum class BusGraphModel {
+	// Edge from every stop to every later stop of the bus: O(k^2) edges.
+	DENSE,
+	// Chain of ride vertices with boarding and alighting edges: O(k) edges.
+	LINEAR
+};
+
+// Model named as in the --bus-graph flag: "dense" or "linear".
+std::optional<BusGraphModel> ReadBusGraphModel(std::string_view name) {
+	if (name == "dense") {
+		return BusGraphModel::DENSE;
+	} else if (name == "linear") {
+		return BusGraphModel::LINEAR;
+	}
+	return std::nullopt;
+}
+
+struct DbSettings {
+	// Threads for computing bus stats and edges.
+	size_t thread_count = DefaultThreadCount();
+	// Curvature of a bus is computed on its first Bus request instead of in UpdateDb.
+	bool lazy_bus_stats = false;
+	RouterMode router_mode = RouterMode::AUTO;
+	BusGraphModel bus_graph_model = BusGraphModel::DENSE;
+	Graph::RouterSettings router_settings = { DefaultThreadCount(), 64 };
+	// Receives UpdateDb phase times and graph sizes when set.
+	Metrics* metrics = nullptr;
+};
 
 enum class ActivityType {
 	BUS,
 	WAIT
 };
 
+// Stop id for WAIT, bus id for BUS.
 struct Activity {
-	ActivityType type;
-	std::string name;
+	ActivityType type = ActivityType::WAIT;
+	NameId id = 0;
 	int count = 0;
 	double time = 0;
 
-	Activity(ActivityType t, const std::string& str, int c, double ti) : type(t), name(str), count(c), time(ti) {}
+	Activity(ActivityType t, NameId i, int c, double ti) : type(t), id(i), count(c), time(ti) {}
 	Activity(int ti) : time(ti) {}
 	Activity() {};
 };
 
+static_assert(std::is_trivially_copyable_v<Activity>);
+
+namespace Graph {
+	template <>
+	struct WeightTraits<Activity> {
+		using Cost = double;
+
+		static Cost GetCost(const Activity& activity) {
+			return activity.time;
+		}
+	};
+}
+
 bool operator>=(const Activity& left, int right) {
 	return left.time >= right;
 }
@@ -48,191 +114,853 @@ Activity operator+(const Activity& left, const Activity& right) {
 }
 
 struct Bus {
-	std::string name;
+	std::pmr::string name;
 
 	bool is_roundtrip;
-	std::vector<std::string> stops_list;
-	std::optional<Route> route = std::nullopt;
-
+	std::pmr::vector<std::pmr::string> stops_list;
 };
 
-Bus ReadBus(const std::map<std::string, Json::Node>& json_bus) {
-	Bus bus;
+Bus ReadBus(const Json::Dict& json_bus, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	Bus bus{ std::pmr::string(resource), false, std::pmr::vector<std::pmr::string>(resource) };
 
 	bus.name = json_bus.at("name").AsString();
 
 	bus.is_roundtrip = json_bus.at("is_roundtrip").AsBool();
 
-	for (const auto& stop_name_node : json_bus.at("stops").AsArray()) {
-		bus.stops_list.push_back(stop_name_node.AsString());
+	const auto& stops = json_bus.at("stops").AsArray();
+	bus.stops_list.reserve(bus.is_roundtrip || stops.empty() ? stops.size() : 2 * stops.size() - 1);
+	for (const auto& stop_name_node : stops) {
+		bus.stops_list.emplace_back(stop_name_node.AsString());
 	}
 
-	if (!bus.is_roundtrip) {
-		std::vector<std::string> temp;
-		std::reverse_copy(bus.stops_list.begin(), bus.stops_list.end() - 1, back_inserter(temp));
-		bus.stops_list.insert(bus.stops_list.end(), make_move_iterator(temp.begin()), make_move_iterator(temp.end()));
+	if (!bus.is_roundtrip && !stops.empty()) {
+		for (size_t i = stops.size() - 1; i-- > 0; ) {
+			bus.stops_list.push_back(bus.stops_list[i]);
+		}
 	}
 
 	return bus;
 }
 
+// Destination of one Route request in a group sharing the origin.
+struct RouteTarget {
+	int id;
+	std::string_view to;
+};
+
 class RouteManager {
 private:
-	std::unordered_map<std::string, Stop> stops_list_;
-	std::unordered_map<std::string, Bus> bus_list_;
-	std::unordered_map<std::string, std::set<std::string>> stop_bus_;
+	// Ids of both tables index every per-stop and per-bus vector below.
+	NameTable stop_names_;
+	NameTable bus_names_;
+
+	std::vector<StopInfo> stops_;
+	RoadDistanceTable road_distances_;
+	// Buses through every stop, sorted by bus name.
+	std::vector<std::vector<NameId>> stop_buses_;
+	std::vector<Route> routes_;
 
 	int bus_wait_time = 0;
 	double bus_velocity = 0;
 
 	Graph::DirectedWeightedGraph<Activity> graph_;
-	std::optional<Graph::Router<Activity>> router_ = std::nullopt;
+	using PrecomputedRouter = Graph::Router<Activity>;
+	using OnDemandRouter = Graph::DijkstraRouter<Activity>;
+	std::optional<std::variant<PrecomputedRouter, OnDemandRouter>> router_ = std::nullopt;
+
+	static const size_t MAX_PRECOMPUTED_VERTEX_COUNT = 2000;
+	static constexpr uint64_t NO_GRAPH_POS = std::numeric_limits<uint64_t>::max();
 	
 	Graph::VertexId next_vertex = 0;
 
-	std::unordered_map<std::string, Graph::VertexId> stop_graph_pos;
+	// Wait vertex of every stop, NO_GRAPH_POS for stops that are only referenced.
+	std::vector<uint64_t> stop_graph_pos;
+
+	struct BusGraphRange {
+		Graph::EdgeId begin = 0;
+		Graph::EdgeId end = 0;
+		size_t ride_vertex_count = 0;
+	};
+
+	// Edges and ride vertices of every bus in graph_, so that an updated bus can replace its own.
+	std::vector<BusGraphRange> bus_graph_ranges_;
+
+	// Replaced edges and the ride vertices only they used; see ShouldCompactGraph.
+	size_t dead_edge_count_ = 0;
+	size_t dead_vertex_count_ = 0;
+
+	// What the base requests since the last UpdateDb changed, so that an update rejected
+	// by CheckChangedBuses can be undone: table sizes and settings before the first change,
+	// then the previous version of every stop and bus that existed before, in change order.
+	struct UndoLog {
+		size_t stop_count = 0;
+		size_t bus_count = 0;
+		Graph::VertexId next_vertex = 0;
+		int bus_wait_time = 0;
+		double bus_velocity = 0;
+		bool routing_settings_changed = false;
+		std::vector<std::tuple<NameId, StopInfo, uint64_t>> stops;
+		std::vector<std::pair<NameId, Route>> buses;
+	};
+	std::optional<UndoLog> undo_;
+
+	// Changes since the last UpdateDb: stops that got their vertices and buses to rebuild.
+	std::vector<NameId> new_stops_;
+	std::vector<NameId> changed_buses_;
+	// Road distances are resolved again only when a stop was added or changed.
+	bool stops_changed_ = false;
+	bool routing_settings_changed_ = false;
+
+	// Merged route items; a null pointer in the cache means there is no route.
+	struct RouteItems {
+		double total_time = 0;
+		std::vector<Activity> activities;
+	};
+
+	using RouteKey = std::pair<Graph::VertexId, Graph::VertexId>;
+
+	struct RouteKeyHasher {
+		size_t operator()(const RouteKey& key) const {
+			return key.first * 2'946'901 + key.second;
+		}
+	};
+
+	// Set when bus curvature is computed on demand, see DbSettings::lazy_bus_stats.
+	std::optional<StopCoordinates> stop_coordinates_;
+	mutable std::unique_ptr<std::once_flag[]> curvature_once_;
+
+	using RouteCache = LruCache<RouteKey, std::shared_ptr<const RouteItems>, RouteKeyHasher>;
+	std::unique_ptr<RouteCache> route_cache_;
+
+	NameId InternStop(std::string_view name) {
+		const NameId stop_id = stop_names_.Intern(name);
+		if (stop_id == stops_.size()) {
+			stops_.emplace_back();
+			stop_buses_.emplace_back();
+			stop_graph_pos.push_back(NO_GRAPH_POS);
+			stops_changed_ = true;
+		}
+		return stop_id;
+	}
+
+	bool IsStopKnown(NameId stop_id) const {
+		return stop_graph_pos[stop_id] != NO_GRAPH_POS || !stop_buses_[stop_id].empty();
+	}
+
+	void UnlinkBus(NameId bus_id) {
+		for (const NameId stop_id : routes_[bus_id].GetStops()) {
+			auto& buses = stop_buses_[stop_id];
+			buses.erase(std::remove(buses.begin(), buses.end(), bus_id), buses.end());
+		}
+	}
+
+	void AddBus(NameId bus_id, Route route) {
+		if (bus_id < routes_.size()) {
+			UnlinkBus(bus_id);
+		}
+
+		for (const NameId stop_id : route.GetStops()) {
+			auto& buses = stop_buses_[stop_id];
+			const auto it = std::lower_bound(buses.begin(), buses.end(), bus_id, [this](NameId lhs, NameId rhs) {
+				return bus_names_.GetName(lhs) < bus_names_.GetName(rhs);
+			});
+			if (it == buses.end() || *it != bus_id) {
+				buses.insert(it, bus_id);
+			}
+		}
+
+		if (bus_id == routes_.size()) {
+			routes_.push_back(std::move(route));
+		}
+		else {
+			routes_[bus_id] = std::move(route);
+		}
+	}
+
+	void StartChanges() {
+		if (undo_) {
+			return;
+		}
+		undo_.emplace();
+		undo_->stop_count = stops_.size();
+		undo_->bus_count = routes_.size();
+		undo_->next_vertex = next_vertex;
+		undo_->bus_wait_time = bus_wait_time;
+		undo_->bus_velocity = bus_velocity;
+		undo_->routing_settings_changed = routing_settings_changed_;
+	}
+
+	// Throws before anything is rebuilt if a changed bus goes through a stop that was only
+	// referenced or between consecutive stops without a road distance.
+	void CheckChangedBuses() const {
+		for (const NameId bus_id : changed_buses_) {
+			const auto& stops = routes_[bus_id].GetStops();
+			for (size_t i = 0; i < stops.size(); ++i) {
+				if (stop_graph_pos[stops[i]] == NO_GRAPH_POS) {
+					throw std::invalid_argument("Bus " + std::string(bus_names_.GetName(bus_id))
+						+ " goes through unknown stop " + std::string(stop_names_.GetName(stops[i])));
+				}
+				if (i > 0 && !road_distances_.Find(stops[i - 1], stops[i])) {
+					throw std::invalid_argument("Bus " + std::string(bus_names_.GetName(bus_id))
+						+ " has no road distance from " + std::string(stop_names_.GetName(stops[i - 1]))
+						+ " to " + std::string(stop_names_.GetName(stops[i])));
+				}
+			}
+		}
+	}
+
+	// Restores the stops, buses and settings recorded in undo_, newest change first.
+	void RollBackChanges() {
+		auto& undo = *undo_;
+		for (auto it = undo.buses.rbegin(); it != undo.buses.rend(); ++it) {
+			AddBus(it->first, std::move(it->second));
+		}
+		for (NameId bus_id = undo.bus_count; bus_id < routes_.size(); ++bus_id) {
+			UnlinkBus(bus_id);
+		}
+		routes_.resize(undo.bus_count);
+		bus_names_.Truncate(undo.bus_count);
 
-	void BuildRouteInGraph(const Bus& bus) {
-		const auto& stops_list = bus.stops_list;
+		for (auto it = undo.stops.rbegin(); it != undo.stops.rend(); ++it) {
+			auto&[stop_id, info, graph_pos] = *it;
+			stops_[stop_id] = std::move(info);
+			stop_graph_pos[stop_id] = graph_pos;
+		}
+		stops_.resize(undo.stop_count);
+		stop_buses_.resize(undo.stop_count);
+		stop_graph_pos.resize(undo.stop_count);
+		stop_names_.Truncate(undo.stop_count);
+
+		next_vertex = undo.next_vertex;
+		bus_wait_time = undo.bus_wait_time;
+		bus_velocity = undo.bus_velocity;
+		routing_settings_changed_ = undo.routing_settings_changed;
+		new_stops_.clear();
+		changed_buses_.clear();
+		stops_changed_ = true;
+		undo_.reset();
+	}
+
+	using Edges = std::vector<Graph::Edge<Activity>>;
+
+	void BuildRouteInGraph(const Route& route, NameId bus_id, Graph::VertexId first_ride_pos, BusGraphModel model, Edges& edges) const {
+		if (model == BusGraphModel::LINEAR) {
+			BuildLinearRouteInGraph(route, bus_id, first_ride_pos, edges);
+		}
+		else {
+			BuildDenseRouteInGraph(route, bus_id, edges);
+		}
+	}
+
+	void BuildDenseRouteInGraph(const Route& route, NameId bus_id, Edges& edges) const {
+		const auto& stops_list = route.GetStops();
 		for (size_t i = 0; i < stops_list.size(); ++i) {
 			
-			const auto current_stop_pos = stop_graph_pos.at(stops_list[i]) + 1;
+			const auto current_stop_pos = stop_graph_pos[stops_list[i]] + 1;
 			
-			double distance = 0;
 			for (size_t j = i + 1; j < stops_list.size(); ++j) {
 				
 				if (stops_list[i] != stops_list[j]) {
-					distance += ComputeRouteDistance(stops_list_.at(stops_list[j - 1]), stops_list_.at(stops_list[j]));
-					graph_.AddEdge({ current_stop_pos,
-									 stop_graph_pos.at(stops_list[j]),
-									 { ActivityType::BUS, bus.name, static_cast<int> (j - i), distance / bus_velocity * 60 / 1000 } });
+					const double distance = route.GetDistance(i, j);
+					edges.push_back({ current_stop_pos,
+									  stop_graph_pos[stops_list[j]],
+									  { ActivityType::BUS, bus_id, static_cast<int> (j - i), distance / bus_velocity * 60 / 1000 } });
 				}
 			}
 		}
 	
 	}
 
-public:
-	RouteManager() : graph_(200) {}
+	// Ride vertex of the i-th stop is first_ride_pos + i.
+	void BuildLinearRouteInGraph(const Route& route, NameId bus_id, Graph::VertexId first_ride_pos, Edges& edges) const {
+		const auto& stops_list = route.GetStops();
+		for (size_t i = 0; i < stops_list.size(); ++i) {
+
+			const auto stop_pos = stop_graph_pos[stops_list[i]];
+			const auto ride_pos = first_ride_pos + i;
+
+			if (i + 1 < stops_list.size()) {
+				edges.push_back({ stop_pos + 1, ride_pos, { ActivityType::BUS, bus_id, 0, 0 } });
+			}
+			if (i > 0) {
+				const double distance = route.GetDistance(i - 1, i);
+				edges.push_back({ ride_pos - 1, ride_pos, { ActivityType::BUS, bus_id, 1, distance / bus_velocity * 60 / 1000 } });
+				edges.push_back({ ride_pos, stop_pos, { ActivityType::BUS, bus_id, 0, 0 } });
+			}
+		}
+	}
+
+	// Geo lengths of the segments of all the buses are computed in one batch.
+	void ComputeCurvatures(const std::vector<NameId>& bus_ids, size_t thread_count) {
+		static const size_t GEO_BLOCK_SIZE = 1 << 12;
+
+		const StopCoordinates coordinates(stops_);
+
+		std::vector<size_t> first_segment(bus_ids.size() + 1, 0);
+		std::vector<NameId> segment_from;
+		std::vector<NameId> segment_to;
+		for (size_t i = 0; i < bus_ids.size(); ++i) {
+			const auto& stops = routes_[bus_ids[i]].GetStops();
+			if (!stops.empty()) {
+				segment_from.insert(segment_from.end(), stops.begin(), stops.end() - 1);
+				segment_to.insert(segment_to.end(), stops.begin() + 1, stops.end());
+			}
+			first_segment[i + 1] = segment_from.size();
+		}
+
+		const size_t segment_count = segment_from.size();
+		std::vector<double> geo_distances(segment_count);
+		ParallelFor((segment_count + GEO_BLOCK_SIZE - 1) / GEO_BLOCK_SIZE, thread_count, [&](size_t block) {
+			const size_t begin = block * GEO_BLOCK_SIZE;
+			coordinates.ComputeGeoDistances(segment_from.data() + begin, segment_to.data() + begin,
+				std::min(GEO_BLOCK_SIZE, segment_count - begin), geo_distances.data() + begin);
+		});
+
+		ParallelFor(bus_ids.size(), thread_count, [&](size_t i) {
+			routes_[bus_ids[i]].ComputeCurvature(geo_distances.data() + first_segment[i]);
+		});
+	}
+
+	// Route with its curvature computed, on the first call for the bus when stats are lazy.
+	const Route& GetRoute(NameId bus_id) const {
+		const auto& route = routes_[bus_id];
+		if (curvature_once_) {
+			std::call_once(curvature_once_[bus_id], [&] {
+				thread_local std::vector<double> geo_distances;
+				const auto& stops = route.GetStops();
+				if (stops.empty()) {
+					return;
+				}
+				geo_distances.resize(stops.size() - 1);
+				stop_coordinates_->ComputeGeoDistances(stops.data(), stops.data() + 1, stops.size() - 1, geo_distances.data());
+				route.ComputeCurvature(geo_distances.data());
+			});
+		}
+		return route;
+	}
+
+	// Every changed bus computes its stats and edges on its own; edges are then appended in bus
+	// order, so edge ids don't depend on the thread count. Edges of other buses keep their ids,
+	// replaced ones become zero-weight self-loops that no route goes through until ResetGraph drops them.
+	// Returns whether any edge was replaced.
+	bool RebuildChangedBuses(const DbSettings& settings) {
+		const auto& bus_ids = changed_buses_;
+
+		{
+			Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::ROUTE_STATS);
+			ParallelFor(bus_ids.size(), settings.thread_count, [&](size_t i) {
+				routes_[bus_ids[i]].ComputeLenght(road_distances_);
+			});
+
+			if (settings.lazy_bus_stats) {
+				stop_coordinates_.emplace(stops_);
+				curvature_once_ = std::make_unique<std::once_flag[]>(routes_.size());
+			}
+			else {
+				ComputeCurvatures(bus_ids, settings.thread_count);
+			}
+		}
+
+		Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::GRAPH_BUILD);
+		Edges edges = graph_.GetEdges();
+		bool edges_replaced = false;
+		bus_graph_ranges_.resize(routes_.size());
+		for (const NameId bus_id : bus_ids) {
+			const auto range = bus_graph_ranges_[bus_id];
+			for (Graph::EdgeId edge_id = range.begin; edge_id < range.end; ++edge_id) {
+				edges[edge_id] = { edges[edge_id].from, edges[edge_id].from, Activity() };
+			}
+			edges_replaced = edges_replaced || range.begin != range.end;
+			dead_edge_count_ += range.end - range.begin;
+			dead_vertex_count_ += range.ride_vertex_count;
+		}
+
+		for (const NameId stop_id : new_stops_) {
+			const auto stop_pos = stop_graph_pos[stop_id];
+			edges.push_back({ stop_pos,
+							  stop_pos + 1,
+							  { ActivityType::WAIT, stop_id, 0, static_cast<double> (bus_wait_time) } });
+		}
+
+		std::vector<Graph::VertexId> first_ride_pos(bus_ids.size() + 1, next_vertex);
+		if (settings.bus_graph_model == BusGraphModel::LINEAR) {
+			for (size_t i = 0; i < bus_ids.size(); ++i) {
+				first_ride_pos[i + 1] = first_ride_pos[i] + routes_[bus_ids[i]].CountOfStops();
+			}
+		}
+		next_vertex = first_ride_pos.back();
+
+		std::vector<Edges> bus_edges(bus_ids.size());
+		ParallelFor(bus_ids.size(), settings.thread_count, [&](size_t i) {
+			BuildRouteInGraph(routes_[bus_ids[i]], bus_ids[i], first_ride_pos[i], settings.bus_graph_model, bus_edges[i]);
+		});
+
+		std::vector<size_t> first_edge(bus_ids.size() + 1, edges.size());
+		for (size_t i = 0; i < bus_ids.size(); ++i) {
+			first_edge[i + 1] = first_edge[i] + bus_edges[i].size();
+			bus_graph_ranges_[bus_ids[i]] = { first_edge[i], first_edge[i + 1], first_ride_pos[i + 1] - first_ride_pos[i] };
+		}
+		edges.resize(first_edge.back());
+		ParallelFor(bus_ids.size(), settings.thread_count, [&](size_t i) {
+			std::copy(bus_edges[i].begin(), bus_edges[i].end(), edges.begin() + first_edge[i]);
+			Edges().swap(bus_edges[i]);
+		});
+
+		graph_ = Graph::DirectedWeightedGraph<Activity>(next_vertex, std::move(edges));
+
+		new_stops_.clear();
+		changed_buses_.clear();
+		return edges_replaced;
+	}
+
+	// Whether the edges and ride vertices replaced by the changed buses would make up more
+	// than half of the graph. Rebuilding it then keeps a long-running server from growing
+	// with every update, at the cost of a full build once per as many replaced edges.
+	bool ShouldCompactGraph() const {
+		size_t dead_edge_count = dead_edge_count_;
+		size_t dead_vertex_count = dead_vertex_count_;
+		for (const NameId bus_id : changed_buses_) {
+			if (bus_id < bus_graph_ranges_.size()) {
+				const auto& range = bus_graph_ranges_[bus_id];
+				dead_edge_count += range.end - range.begin;
+				dead_vertex_count += range.ride_vertex_count;
+			}
+		}
+		return dead_edge_count > graph_.GetEdgeCount() / 2 || dead_vertex_count > graph_.GetVertexCount() / 2;
+	}
 
+	// Builds the graph anew with consecutive vertex ids and no dead edges. Wait time and
+	// velocity are in the weight of every edge, so a change of them needs this too.
+	void ResetGraph() {
+		std::vector<NameId> stop_ids;
+		for (NameId stop_id = 0; stop_id < stops_.size(); ++stop_id) {
+			if (stop_graph_pos[stop_id] != NO_GRAPH_POS) {
+				stop_ids.push_back(stop_id);
+			}
+		}
+		std::sort(stop_ids.begin(), stop_ids.end(), [this](NameId lhs, NameId rhs) {
+			return stop_graph_pos[lhs] < stop_graph_pos[rhs];
+		});
+
+		next_vertex = 0;
+		for (const NameId stop_id : stop_ids) {
+			stop_graph_pos[stop_id] = next_vertex;
+			next_vertex += 2;
+		}
+		new_stops_ = std::move(stop_ids);
+
+		changed_buses_.resize(routes_.size());
+		for (NameId bus_id = 0; bus_id < routes_.size(); ++bus_id) {
+			changed_buses_[bus_id] = bus_id;
+		}
+		bus_graph_ranges_.clear();
+		dead_edge_count_ = 0;
+		dead_vertex_count_ = 0;
+
+		router_.reset();
+		graph_ = {};
+		routing_settings_changed_ = false;
+	}
+
+public:
+	// Stops and buses inserted after UpdateDb are applied by the next call to it.
 	void InsertStop(Stop& stop) {
-		
-		std::string name = stop.name;
-		stop_graph_pos[stop.name] = next_vertex;
-		stops_list_[stop.name] = std::move(stop);
-		
-		graph_.AddEdge({ next_vertex, 
-						 next_vertex + 1, 
-			             { ActivityType::WAIT, move(name), 0, static_cast<double> (bus_wait_time) }});
-		next_vertex += 2;
+		StartChanges();
+		const NameId stop_id = InternStop(stop.name);
+
+		StopInfo info{ stop.latitude, stop.longitude, {} };
+		info.road_distances.reserve(stop.other_stops_distance.size());
+		for (const auto&[other_stop, distance] : stop.other_stops_distance) {
+			info.road_distances.push_back({ InternStop(other_stop), distance });
+		}
+		std::sort(info.road_distances.begin(), info.road_distances.end(), [](const RoadDistance& lhs, const RoadDistance& rhs) {
+			return lhs.to < rhs.to;
+		});
+
+		const bool is_new = stop_graph_pos[stop_id] == NO_GRAPH_POS;
+		if (!is_new && stops_[stop_id] == info) {
+			return;
+		}
+		if (stop_id < undo_->stop_count) {
+			undo_->stops.emplace_back(stop_id, std::move(stops_[stop_id]), stop_graph_pos[stop_id]);
+		}
+		stops_[stop_id] = std::move(info);
+		stops_changed_ = true;
+		if (is_new) {
+			stop_graph_pos[stop_id] = next_vertex;
+			next_vertex += 2;
+			new_stops_.push_back(stop_id);
+		}
+		// Stats and edges of these buses depend on the stop's coordinates and road distances.
+		changed_buses_.insert(changed_buses_.end(), stop_buses_[stop_id].begin(), stop_buses_[stop_id].end());
 	}
 
 	void GetRoutesSettings(int wait_time, double velocity) {
+		StartChanges();
+		routing_settings_changed_ = router_ && (wait_time != bus_wait_time || velocity != bus_velocity);
 		bus_wait_time = wait_time;
 		bus_velocity = velocity;
 	}
 
-	void InsertBus(Bus& bus) {
+	void InsertBus(::Bus& bus) {
+		StartChanges();
 		Route::Stops stops;
 		stops.reserve(bus.stops_list.size());
-
 		for (const auto& stop_name : bus.stops_list) {
-			Stop& stop = stops_list_[stop_name];
-			if (stop.name.empty()) {
-				stop.name = stop_name;
+			stops.push_back(InternStop(stop_name));
+		}
+
+		const NameId bus_id = bus_names_.Intern(bus.name);
+		if (bus_id < routes_.size() && routes_[bus_id].GetStops() == stops) {
+			return;
+		}
+		if (bus_id < undo_->bus_count) {
+			undo_->buses.emplace_back(bus_id, routes_[bus_id]);
+		}
+		AddBus(bus_id, Route(move(stops)));
+		changed_buses_.push_back(bus_id);
+	}
+
+	// Undoes the stops, buses and settings inserted since the last UpdateDb.
+	void DiscardChanges() {
+		if (undo_) {
+			RollBackChanges();
+		}
+	}
+
+	// The first call builds the whole database, later ones rebuild only the changed buses. The
+	// all-pairs table is then repaired when edges were only added and computed anew otherwise.
+	// Changes with a bus that can't be routed are undone and the error is rethrown.
+	void UpdateDb(const DbSettings& settings = {}) {
+		std::sort(changed_buses_.begin(), changed_buses_.end());
+		changed_buses_.erase(std::unique(changed_buses_.begin(), changed_buses_.end()), changed_buses_.end());
+
+		{
+			Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::ROUTE_STATS);
+			if (stops_changed_) {
+				road_distances_ = RoadDistanceTable(stops_);
+				stops_changed_ = false;
+			}
+		}
+		try {
+			CheckChangedBuses();
+		} catch (...) {
+			DiscardChanges();
+			throw;
+		}
+		undo_.reset();
+
+		if (routing_settings_changed_ || ShouldCompactGraph()) {
+			ResetGraph();
+		}
+		if (router_ && new_stops_.empty() && changed_buses_.empty()) {
+			return;
+		}
+
+		const Graph::EdgeId first_new_edge = graph_.GetEdgeCount();
+		const bool edges_replaced = RebuildChangedBuses(settings);
+
+		RouterMode mode = settings.router_mode;
+		if (mode == RouterMode::AUTO) {
+			mode = graph_.GetVertexCount() <= MAX_PRECOMPUTED_VERTEX_COUNT
+				? RouterMode::PRECOMPUTED
+				: RouterMode::ON_DEMAND;
+		}
+
+		{
+			Metrics::ScopedPhase phase(settings.metrics, Metrics::Phase::ROUTER);
+			auto* precomputed_router = router_ ? std::get_if<PrecomputedRouter>(&*router_) : nullptr;
+			if (mode == RouterMode::ON_DEMAND) {
+				router_.emplace(std::in_place_type<OnDemandRouter>, graph_);
 			}
+			else if (precomputed_router && !edges_replaced) {
+				precomputed_router->AddEdges(first_new_edge, settings.router_settings.thread_count);
+			}
+			else {
+				router_.emplace(std::in_place_type<PrecomputedRouter>, graph_, settings.router_settings);
+			}
+		}
 
-			stop_bus_[stop_name].insert(bus.name);
-			stops.push_back(&stops_list_[stop_name]);
+		if (settings.metrics) {
+			const auto* precomputed_router = std::get_if<PrecomputedRouter>(&*router_);
+			settings.metrics->SetCounter("graph_vertices", graph_.GetVertexCount());
+			settings.metrics->SetCounter("graph_edges", graph_.GetEdgeCount());
+			settings.metrics->SetCounter("router_table_bytes", precomputed_router
+				? precomputed_router->GetCosts().capacity() * sizeof(precomputed_router->GetCosts()[0])
+					+ precomputed_router->GetPrevEdges().capacity() * sizeof(precomputed_router->GetPrevEdges()[0])
+				: 0);
 		}
 
-		bus.route = std::make_optional <Route>(stops);
-		bus_list_[bus.name] = std::move(bus);
+		if (route_cache_) {
+			ConfigureRouteCache(route_cache_->GetCapacity());
+		}
 	}
 
-	void UpdateDb() {
-		
-		for (auto&[name, bus] : bus_list_) {
-			bus.route->ComputeLenghtAndCurvature();
-			BuildRouteInGraph(bus);
+	// Saves the state reached after UpdateDb, router table included.
+	void SaveSnapshot(const std::string& path) const {
+		Snapshot::Writer out(path);
+
+		out.Write(bus_wait_time);
+		out.Write(bus_velocity);
+		out.Write(static_cast<uint64_t>(next_vertex));
+
+		out.Write(static_cast<uint64_t>(stops_.size()));
+		for (NameId stop_id = 0; stop_id < stops_.size(); ++stop_id) {
+			const auto& stop = stops_[stop_id];
+			out.WriteString(stop_names_.GetName(stop_id));
+			out.Write(stop.latitude);
+			out.Write(stop.longitude);
+			out.Write(stop_graph_pos[stop_id]);
+			out.WriteVector(stop.road_distances);
+		}
+
+		out.Write(static_cast<uint64_t>(routes_.size()));
+		for (NameId bus_id = 0; bus_id < routes_.size(); ++bus_id) {
+			const auto& route = GetRoute(bus_id);
+			out.WriteString(bus_names_.GetName(bus_id));
+			out.WriteVector(route.GetStops());
+			out.Write(route.GetLenght());
+			out.Write(route.GetCurvature());
 		}
-		
-		router_.emplace(graph_);
+
+		out.WriteVector(bus_graph_ranges_);
+		out.Write(static_cast<uint64_t>(dead_edge_count_));
+		out.Write(static_cast<uint64_t>(dead_vertex_count_));
+
+		out.Write(static_cast<uint64_t>(graph_.GetVertexCount()));
+		out.WriteVector(graph_.GetEdges());
+
+		const auto* router = router_ ? std::get_if<PrecomputedRouter>(&*router_) : nullptr;
+		out.Write(router != nullptr);
+		if (router) {
+			out.WriteVector(router->GetCosts());
+			out.WriteVector(router->GetPrevEdges());
+		}
+		out.Finish();
 	}
 
-	void Bus(Json::Document& out, int id, const std::string& bus_name) const {
-		auto it = bus_list_.find(bus_name);
-		std::map<std::string, Json::Node> node;
-		if (it == bus_list_.end()) {
-			node.emplace("request_id", Json::Node(static_cast<double> (id)));
-			node.emplace("error_message", Json::Node(std::string("not found")));
+	// Restores a snapshot into an empty manager instead of running UpdateDb.
+	// Base requests inserted afterwards are applied on top of it by UpdateDb.
+	void LoadSnapshot(const std::string& path) {
+		const Snapshot::MappedFile file(path);
+		Snapshot::Reader in(file.GetData());
+
+		bus_wait_time = in.Read<int>();
+		bus_velocity = in.Read<double>();
+		next_vertex = in.Read<uint64_t>();
+
+		const size_t stop_count = in.Read<uint64_t>();
+		for (size_t i = 0; i < stop_count; ++i) {
+			const NameId stop_id = InternStop(in.ReadString());
+			auto& stop = stops_[stop_id];
+			stop.latitude = in.Read<double>();
+			stop.longitude = in.Read<double>();
+			stop_graph_pos[stop_id] = in.Read<uint64_t>();
+			stop.road_distances = in.ReadVector<RoadDistance>();
+		}
+
+		const size_t bus_count = in.Read<uint64_t>();
+		for (size_t i = 0; i < bus_count; ++i) {
+			const NameId bus_id = bus_names_.Intern(in.ReadString());
+			AddBus(bus_id, Route(in.ReadVector<NameId>()));
+			const int route_lenght = in.Read<int>();
+			const double curvature = in.Read<double>();
+			routes_[bus_id].SetLenghtAndCurvature(route_lenght, curvature);
+		}
+
+		bus_graph_ranges_ = in.ReadVector<BusGraphRange>();
+		dead_edge_count_ = in.Read<uint64_t>();
+		dead_vertex_count_ = in.Read<uint64_t>();
+
+		const size_t vertex_count = in.Read<uint64_t>();
+		graph_ = Graph::DirectedWeightedGraph<Activity>(vertex_count, in.ReadVector<Graph::Edge<Activity>>());
+
+		if (in.Read<bool>()) {
+			auto costs = in.ReadVector<PrecomputedRouter::Cost>();
+			auto prev_edges = in.ReadVector<PrecomputedRouter::PackedEdgeId>();
+			router_.emplace(std::in_place_type<PrecomputedRouter>, graph_, move(costs), move(prev_edges));
+		}
+		else {
+			router_.emplace(std::in_place_type<OnDemandRouter>, graph_);
+		}
+	}
+
+	// Responses are written with keys in alphabetical order, the same order Json::Dict prints them in.
+	void Bus(Json::Writer& out, int id, std::string_view bus_name) const {
+		const auto bus_id = bus_names_.Find(bus_name);
+		out.BeginObject();
+		if (!bus_id) {
+			out.Key("error_message").Value("not found");
+			out.Key("request_id").Value(static_cast<double> (id));
+		}
+		else {
+			const auto& route = GetRoute(*bus_id);
+
+			out.Key("curvature").Value(route.GetCurvature());
+			out.Key("request_id").Value(static_cast<double> (id));
+			out.Key("route_length").Value(static_cast<double> (route.GetLenght()));
+			out.Key("stop_count").Value(static_cast<double> (route.CountOfStops()));
+			out.Key("unique_stop_count").Value(static_cast<double> (route.CountOfUniqueStops()));
+		}
+		out.EndObject();
+	}
+
+	void ViewStopBuses(Json::Writer& out, int id, std::string_view stop_name) const {
+		const auto stop_id = stop_names_.Find(stop_name);
+		out.BeginObject();
+		if (!stop_id || !IsStopKnown(*stop_id)) {
+			out.Key("error_message").Value("not found");
 		}
 		else {
-			const auto& bus = it->second;
+			out.Key("buses").BeginArray();
+			for (const NameId bus_id : stop_buses_[*stop_id]) {
+				out.Value(bus_names_.GetName(bus_id));
+			}
+			out.EndArray();
+		}
+		out.Key("request_id").Value(static_cast<double>(id));
+		out.EndObject();
+	}
+
+	void BuildRoute(Json::Writer& out, int id, std::string_view from, std::string_view to) const {
+		std::visit([&](const auto& router) {
+			BuildRoute(router, out, id, FindStopVertex(from), FindStopVertex(to));
+		}, *router_);
+	}
+
+	// Answers Route requests from one stop; responses[i] is the response to targets[i].
+	// Without a precomputed table all of them are answered from one shortest-path tree.
+	void BuildRoutes(std::string_view from, const RouteTarget* targets, size_t count, std::string* responses,
+		Metrics* metrics = nullptr) const {
+		const auto from_pos = FindStopVertex(from);
+		std::visit([&](const auto& router) {
+			if constexpr (std::is_same_v<std::decay_t<decltype(router)>, OnDemandRouter>) {
+				if (from_pos && count > 1) {
+					BuildRoutes(router.BuildSourceTree(*from_pos), from_pos, targets, count, responses, metrics);
+					return;
+				}
+			}
+			BuildRoutes(router, from_pos, targets, count, responses, metrics);
+		}, *router_);
+	}
 
-			node.emplace("stop_count", Json::Node(static_cast<double> (bus.route->CountOfStops())));
-			node.emplace("unique_stop_count", Json::Node(static_cast<double> (bus.route->CountOfUniqueStops())));
-			node.emplace("route_length", Json::Node(static_cast<double> (bus.route->GetLenght())));
-			node.emplace("curvature", Json::Node(bus.route->GetCurvature()));
-			node.emplace("request_id", Json::Node(static_cast<double> (id)));
+	// Keeps up to capacity answered Route queries; 0 disables the cache.
+	void ConfigureRouteCache(size_t capacity) {
+		route_cache_ = capacity > 0 ? std::make_unique<RouteCache>(capacity) : nullptr;
+	}
+
+	uint64_t GetRouteCacheHits() const {
+		return route_cache_ ? route_cache_->GetHits() : 0;
+	}
+
+	uint64_t GetRouteCacheMisses() const {
+		return route_cache_ ? route_cache_->GetMisses() : 0;
+	}
+
+private:
+	std::optional<Graph::VertexId> FindStopVertex(std::string_view stop_name) const {
+		const auto stop_id = stop_names_.Find(stop_name);
+		if (!stop_id || stop_graph_pos[*stop_id] == NO_GRAPH_POS) {
+			return std::nullopt;
 		}
+		return stop_graph_pos[*stop_id];
+	}
 
-		out.AddNode(Json::Node(move(node)));
+	template <typename RouterType>
+	void BuildRoutes(const RouterType& router, std::optional<Graph::VertexId> from_pos,
+		const RouteTarget* targets, size_t count, std::string* responses, Metrics* metrics) const {
+		Json::Writer out;
+		for (size_t i = 0; i < count; ++i) {
+			const auto start = metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+			BuildRoute(router, out, targets[i].id, from_pos, FindStopVertex(targets[i].to));
+			responses[i] = out.Extract();
+			if (metrics) {
+				const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+				metrics->GetLatencies("Route").Record(latency.count());
+			}
+		}
 	}
 
-	void ViewStopBuses(Json::Document& out, int id, const std::string& stop_name) const {
-		auto stop = stops_list_.find(stop_name);
-		auto have_bus = stop_bus_.find(stop_name);
-		std::map<std::string, Json::Node> node;
-		std::vector<Json::Node> buses;
-		if (stop != stops_list_.end() && have_bus != stop_bus_.end()) {
-			for (const auto& bus : stop_bus_.at(stop_name)) {
-				buses.push_back(Json::Node(std::string(bus)));
+	template <typename RouterType>
+	void BuildRoute(const RouterType& router, Json::Writer& out, int id,
+		std::optional<Graph::VertexId> from_pos, std::optional<Graph::VertexId> to_pos) const {
+		if (!from_pos || !to_pos) {
+			WriteRoute(out, id, nullptr);
+			return;
+		}
+
+		const RouteKey key{ *from_pos, *to_pos };
+		if (route_cache_) {
+			if (const auto cached = route_cache_->Get(key)) {
+				WriteRoute(out, id, cached->get());
+				return;
 			}
-			node.emplace("buses", Json::Node(move(buses)));
 		}
-		else if (stop == stops_list_.end()) {
-			node.emplace("error_message", Json::Node(std::string("not found")));
+
+		// Per-thread buffers keep route expansion free of allocations once they have grown.
+		thread_local RouteItems items;
+		const bool found = ExpandRoute(router, key, items);
+		WriteRoute(out, id, found ? &items : nullptr);
+
+		if (route_cache_) {
+			route_cache_->Put(key, found ? std::make_shared<const RouteItems>(items) : nullptr);
 		}
-		else {
-			node.emplace("buses", Json::Node(move(buses)));
+	}
+
+	template <typename RouterType>
+	bool ExpandRoute(const RouterType& router, const RouteKey& key, RouteItems& items) const {
+		thread_local std::vector<Graph::EdgeId> route_edges;
+
+		const auto route = router.BuildRoute(key.first, key.second, route_edges);
+		if (route == std::nullopt) {
+			return false;
 		}
-		node.emplace("request_id", Json::Node(static_cast<double>(id)));
 
-		out.AddNode(Json::Node(move(node)));
+		auto& activities = items.activities;
+		activities.clear();
+		for (const Graph::EdgeId edge_id : route_edges) {
+			const auto& activity = graph_.GetEdge(edge_id).weight;
+			// In the linear model one ride is split into boarding, per-span and alighting edges.
+			if (activity.type == ActivityType::BUS && !activities.empty()
+				&& activities.back().type == ActivityType::BUS && activities.back().id == activity.id) {
+				activities.back().count += activity.count;
+				activities.back().time += activity.time;
+			}
+			else {
+				activities.push_back(activity);
+			}
+		}
+		items.total_time = route->weight.time;
+		return true;
 	}
 
-	void BuildRoute(Json::Document& out, int id, const std::string& from, const std::string& to) const {
-		const auto& route = router_->BuildRoute(stop_graph_pos.at(from), stop_graph_pos.at(to));
-		std::map<std::string, Json::Node> node;
-		std::vector<Json::Node> items;
-		node.emplace("request_id", Json::Node(static_cast<double>(id)));
-		if (route != std::nullopt) {
-			for (size_t i = 0; i < route->edge_count; ++i) {
-				const auto& ref = graph_.GetEdge(router_->GetRouteEdge(route->id, i)).weight;
-				std::map<std::string, Json::Node> act;
+	void WriteRoute(Json::Writer& out, int id, const RouteItems* items) const {
+		out.BeginObject();
+		if (items) {
+			out.Key("items").BeginArray();
+			for (const auto& ref : items->activities) {
+				out.BeginObject();
 				if (ref.type == ActivityType::BUS) {
-					act.emplace("time", Json::Node(ref.time));
-					act.emplace("type", Json::Node(std::string("Bus")));
-					act.emplace("bus", Json::Node(ref.name));
-					act.emplace("span_count", Json::Node(static_cast<double>(ref.count)));
+					out.Key("bus").Value(bus_names_.GetName(ref.id));
+					out.Key("span_count").Value(static_cast<double>(ref.count));
+					out.Key("time").Value(ref.time);
+					out.Key("type").Value("Bus");
 				}
 				else if (ref.type == ActivityType::WAIT) {
-					act.emplace("time", Json::Node(ref.time));
-					act.emplace("type", Json::Node(std::string("Wait")));
-					act.emplace("stop_name", Json::Node(ref.name));
+					out.Key("stop_name").Value(stop_names_.GetName(ref.id));
+					out.Key("time").Value(ref.time);
+					out.Key("type").Value("Wait");
 				}
-
-				items.push_back(Json::Node(move(act)));
+				out.EndObject();
 			}
+			out.EndArray();
 
-
-			node.emplace("items", Json::Node(move(items)));
-			node.emplace("total_time", Json::Node(route->weight.time));
+			out.Key("request_id").Value(static_cast<double>(id));
+			out.Key("total_time").Value(items->total_time);
 		} else {
-			node.emplace("error_message", Json::Node(std::string("not found")));
+			out.Key("error_message").Value("not found");
+			out.Key("request_id").Value(static_cast<double>(id));
 		}
-
-		out.AddNode(Json::Node(move(node)));
+		out.EndObject();
 	}
 };
@@ -1,139 +1,284 @@
 #pragma once
 
 #include "graph.h"
+#include "parallel.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <limits>
+#include <numeric>
 #include <optional>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
+	struct RouterSettings {
+		size_t thread_count = 1;
+		// Side of the square tiles the all-pairs table is relaxed by; 0 relaxes it row by row.
+		size_t block_size = 0;
+	};
+
 	template <typename Weight>
 	class Router {
 	private:
 		using Graph = DirectedWeightedGraph<Weight>;
 
 	public:
-		Router(const Graph& graph);
+		using Cost = typename WeightTraits<Weight>::Cost;
+		using PackedEdgeId = uint32_t;
 
-		using RouteId = uint64_t;
+		Router(const Graph& graph, RouterSettings settings = {});
+		// Restores a table saved with GetCosts and GetPrevEdges without recomputing it.
+		Router(const Graph& graph, std::vector<Cost> costs, std::vector<PackedEdgeId> prev_edges);
 
 		struct RouteInfo {
-			RouteId id;
 			Weight weight;
 			size_t edge_count;
 		};
 
-		std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
-		EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
-		void ReleaseRoute(RouteId route_id);
+		// Replaces the contents of edges with the route's edges in travel order.
+		// Callers reuse the vector between queries, so no memory is allocated per route.
+		std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+		// Repairs the table after the graph got edges with ids from first_new_edge on, and
+		// possibly new vertices. Edges that were there before must not have changed.
+		void AddEdges(EdgeId first_new_edge, size_t thread_count = 1);
+
+		const std::vector<Cost>& GetCosts() const {
+			return costs_;
+		}
+		const std::vector<PackedEdgeId>& GetPrevEdges() const {
+			return prev_edges_;
+		}
 
 	private:
 		const Graph& graph_;
 
-		struct RouteInternalData {
-			Weight weight;
-			std::optional<EdgeId> prev_edge;
-		};
-		using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
+		static_assert(std::numeric_limits<Cost>::has_infinity);
+
+		// Routes table: vertex_count x vertex_count cells stored row by row as two parallel
+		// arrays. A missing route has infinite cost, a route without edges has NO_EDGE.
+		static constexpr Cost UNREACHABLE = std::numeric_limits<Cost>::infinity();
+		static constexpr PackedEdgeId NO_EDGE = std::numeric_limits<PackedEdgeId>::max();
 
-		using ExpandedRoute = std::vector<EdgeId>;
-		mutable RouteId next_route_id_ = 0;
-		mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
+		size_t GetCellIndex(VertexId from, VertexId to) const {
+			return from * vertex_count_ + to;
+		}
 
 		void InitializeRoutesInternalData(const Graph& graph) {
-			const size_t vertex_count = graph.GetVertexCount();
-			for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
-				routes_internal_data_[vertex][vertex] = RouteInternalData{ 0, std::nullopt };
+			assert(graph.GetEdgeCount() < NO_EDGE);
+			for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+				costs_[GetCellIndex(vertex, vertex)] = 0;
 				for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
 					const auto& edge = graph.GetEdge(edge_id);
 					assert(edge.weight >= 0);
-					auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-					if (!route_internal_data || route_internal_data->weight > edge.weight) {
-						route_internal_data = RouteInternalData{ edge.weight, edge_id };
+					const Cost cost = WeightTraits<Weight>::GetCost(edge.weight);
+					const size_t cell = GetCellIndex(vertex, edge.to);
+					if (costs_[cell] > cost) {
+						costs_[cell] = cost;
+						prev_edges_[cell] = static_cast<PackedEdgeId>(edge_id);
 					}
 				}
 			}
 		}
 
-		void RelaxRoute(VertexId vertex_from, VertexId vertex_to,
-			const RouteInternalData& route_from, const RouteInternalData& route_to) {
-			auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
-			const Weight candidate_weight = route_from.weight + route_to.weight;
-			if (!route_relaxing || candidate_weight < route_relaxing->weight) {
-				route_relaxing = {
-					candidate_weight,
-					route_to.prev_edge
-						? route_to.prev_edge
-						: route_from.prev_edge
-				};
+		// Relaxes routes from [from_begin, from_end) to [to_begin, to_end)
+		// through every vertex of [through_begin, through_end), in that order.
+		// The inner loop has no branches so that it can be vectorized.
+		void RelaxBlock(VertexId from_begin, VertexId from_end, VertexId to_begin, VertexId to_end,
+			VertexId through_begin, VertexId through_end) {
+			for (VertexId vertex_through = through_begin; vertex_through < through_end; ++vertex_through) {
+				const Cost* const costs_through = &costs_[GetCellIndex(vertex_through, 0)];
+				const PackedEdgeId* const prev_edges_through = &prev_edges_[GetCellIndex(vertex_through, 0)];
+
+				for (VertexId vertex_from = from_begin; vertex_from < from_end; ++vertex_from) {
+					// Non-negative weights: routes through a vertex never improve its own row.
+					if (vertex_from == vertex_through) {
+						continue;
+					}
+					const size_t cell_through = GetCellIndex(vertex_from, vertex_through);
+					const Cost cost_from = costs_[cell_through];
+					if (cost_from == UNREACHABLE) {
+						continue;
+					}
+					const PackedEdgeId prev_edge_from = prev_edges_[cell_through];
+					Cost* const costs_from = &costs_[GetCellIndex(vertex_from, 0)];
+					PackedEdgeId* const prev_edges_from = &prev_edges_[GetCellIndex(vertex_from, 0)];
+
+					for (VertexId vertex_to = to_begin; vertex_to < to_end; ++vertex_to) {
+						const Cost candidate_cost = cost_from + costs_through[vertex_to];
+						const PackedEdgeId candidate_prev_edge = prev_edges_through[vertex_to] == NO_EDGE
+							? prev_edge_from
+							: prev_edges_through[vertex_to];
+						const bool is_better = candidate_cost < costs_from[vertex_to];
+						costs_from[vertex_to] = is_better ? candidate_cost : costs_from[vertex_to];
+						prev_edges_from[vertex_to] = is_better ? candidate_prev_edge : prev_edges_from[vertex_to];
+					}
+				}
 			}
 		}
 
-		void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
-			for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
-				if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
-					for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
-						if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
-							RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
-						}
+		// Relaxes the whole table through each of vertices_through in turn. Rows other than the one of
+		// the current vertex are independent, so they are relaxed concurrently by threads that are
+		// started once and wait for each other between vertices.
+		void RelaxRowsThrough(const std::vector<VertexId>& vertices_through, size_t thread_count) {
+			static const size_t ROWS_PER_TASK = 16;
+
+			const size_t task_count = (vertex_count_ + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+			ParallelPhases(vertices_through.size(), task_count, thread_count, [&](size_t phase, size_t task) {
+				const VertexId vertex_through = vertices_through[phase];
+				const VertexId from_begin = task * ROWS_PER_TASK;
+				const VertexId from_end = std::min(from_begin + ROWS_PER_TASK, vertex_count_);
+				RelaxBlock(from_begin, from_end, 0, vertex_count_, vertex_through, vertex_through + 1);
+			});
+		}
+
+		void RelaxRoutesByRows(size_t thread_count) {
+			std::vector<VertexId> vertices_through(vertex_count_);
+			std::iota(std::begin(vertices_through), std::end(vertices_through), 0);
+			RelaxRowsThrough(vertices_through, thread_count);
+		}
+
+		// Keeps existing routes and makes the new vertices reachable only from themselves.
+		void ResizeTable(size_t vertex_count) {
+			std::vector<Cost> costs(vertex_count * vertex_count, UNREACHABLE);
+			std::vector<PackedEdgeId> prev_edges(vertex_count * vertex_count, NO_EDGE);
+			for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+				std::copy_n(&costs_[GetCellIndex(vertex, 0)], vertex_count_, &costs[vertex * vertex_count]);
+				std::copy_n(&prev_edges_[GetCellIndex(vertex, 0)], vertex_count_, &prev_edges[vertex * vertex_count]);
+			}
+			for (VertexId vertex = vertex_count_; vertex < vertex_count; ++vertex) {
+				costs[vertex * vertex_count + vertex] = 0;
+			}
+
+			vertex_count_ = vertex_count;
+			costs_ = std::move(costs);
+			prev_edges_ = std::move(prev_edges);
+		}
+
+		// Blocked Floyd-Warshall: for every diagonal tile, relax the tile itself, then the tiles
+		// sharing its rows or columns, then all the others. Tiles of one phase are independent.
+		void RelaxRoutesByBlocks(size_t thread_count, size_t block_size) {
+			const size_t block_count = (vertex_count_ + block_size - 1) / block_size;
+			auto block_begin = [&](size_t block) { return block * block_size; };
+			auto block_end = [&](size_t block) { return std::min(block_begin(block) + block_size, vertex_count_); };
+
+			for (size_t through = 0; through < block_count; ++through) {
+				const VertexId through_begin = block_begin(through);
+				const VertexId through_end = block_end(through);
+
+				RelaxBlock(through_begin, through_end, through_begin, through_end, through_begin, through_end);
+
+				ParallelFor(2 * block_count, thread_count, [&](size_t task) {
+					const size_t block = task / 2;
+					if (block == through) {
+						return;
 					}
-				}
+					if (task % 2 == 0) {
+						RelaxBlock(through_begin, through_end, block_begin(block), block_end(block), through_begin, through_end);
+					}
+					else {
+						RelaxBlock(block_begin(block), block_end(block), through_begin, through_end, through_begin, through_end);
+					}
+				});
+
+				ParallelFor(block_count * block_count, thread_count, [&](size_t task) {
+					const size_t from = task / block_count;
+					const size_t to = task % block_count;
+					if (from == through || to == through) {
+						return;
+					}
+					RelaxBlock(block_begin(from), block_end(from), block_begin(to), block_end(to), through_begin, through_end);
+				});
 			}
 		}
 
-		RoutesInternalData routes_internal_data_;
+		size_t vertex_count_;
+		std::vector<Cost> costs_;
+		std::vector<PackedEdgeId> prev_edges_;
 	};
 
 
 	template <typename Weight>
-	Router<Weight>::Router(const Graph& graph)
+	Router<Weight>::Router(const Graph& graph, RouterSettings settings)
 		: graph_(graph),
-		routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+		vertex_count_(graph.GetVertexCount()),
+		costs_(vertex_count_ * vertex_count_, UNREACHABLE),
+		prev_edges_(vertex_count_ * vertex_count_, NO_EDGE)
 	{
 		InitializeRoutesInternalData(graph);
 
-		const size_t vertex_count = graph.GetVertexCount();
-		for (VertexId vertex_through = 0; vertex_through < vertex_count; ++vertex_through) {
-			RelaxRoutesInternalDataThroughVertex(vertex_count, vertex_through);
+		if (settings.block_size == 0) {
+			RelaxRoutesByRows(settings.thread_count);
+		}
+		else {
+			RelaxRoutesByBlocks(settings.thread_count, settings.block_size);
 		}
 	}
 
 	template <typename Weight>
-	std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
-		const auto& route_internal_data = routes_internal_data_[from][to];
-		if (!route_internal_data) {
-			return std::nullopt;
+	Router<Weight>::Router(const Graph& graph, std::vector<Cost> costs, std::vector<PackedEdgeId> prev_edges)
+		: graph_(graph),
+		vertex_count_(graph.GetVertexCount()),
+		costs_(std::move(costs)),
+		prev_edges_(std::move(prev_edges))
+	{
+		assert(costs_.size() == vertex_count_ * vertex_count_);
+		assert(prev_edges_.size() == vertex_count_ * vertex_count_);
+	}
+
+	template <typename Weight>
+	void Router<Weight>::AddEdges(EdgeId first_new_edge, size_t thread_count) {
+		assert(graph_.GetEdgeCount() < NO_EDGE);
+		if (graph_.GetVertexCount() > vertex_count_) {
+			ResizeTable(graph_.GetVertexCount());
 		}
-		const Weight weight = route_internal_data->weight;
-		std::vector<EdgeId> edges;
-		for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
-			edge_id;
-			edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
-			
-			edges.push_back(*edge_id);
+
+		// A new shortest route is a chain of old routes and new edges, so relaxing
+		// through the ends of the new edges is enough to find all of them.
+		std::vector<VertexId> ends;
+		for (EdgeId edge_id = first_new_edge; edge_id < graph_.GetEdgeCount(); ++edge_id) {
+			const auto& edge = graph_.GetEdge(edge_id);
+			assert(edge.weight >= 0);
+			const Cost cost = WeightTraits<Weight>::GetCost(edge.weight);
+			const size_t cell = GetCellIndex(edge.from, edge.to);
+			if (costs_[cell] > cost) {
+				costs_[cell] = cost;
+				prev_edges_[cell] = static_cast<PackedEdgeId>(edge_id);
+				ends.push_back(edge.from);
+				ends.push_back(edge.to);
+			}
 		}
-		std::reverse(std::begin(edges), std::end(edges));
+		std::sort(std::begin(ends), std::end(ends));
+		ends.erase(std::unique(std::begin(ends), std::end(ends)), std::end(ends));
 
-		const RouteId route_id = next_route_id_++;
-		const size_t route_edge_count = edges.size();
-		expanded_routes_cache_[route_id] = std::move(edges);
-		return RouteInfo{ route_id, weight, route_edge_count };
+		RelaxRowsThrough(ends, thread_count);
 	}
 
 	template <typename Weight>
-	EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
-		return expanded_routes_cache_.at(route_id)[edge_idx];
-	}
+	std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const {
+		edges.clear();
+		if (costs_[GetCellIndex(from, to)] == UNREACHABLE) {
+			return std::nullopt;
+		}
+		for (PackedEdgeId edge_id = prev_edges_[GetCellIndex(from, to)];
+			edge_id != NO_EDGE;
+			edge_id = prev_edges_[GetCellIndex(from, graph_.GetEdge(edge_id).from)]) {
+			
+			edges.push_back(edge_id);
+		}
+		std::reverse(std::begin(edges), std::end(edges));
 
-	template <typename Weight>
-	void Router<Weight>::ReleaseRoute(RouteId route_id) {
-		expanded_routes_cache_.erase(route_id);
+		// The table keeps only costs, the full weight is summed along the route.
+		Weight weight(0);
+		for (const EdgeId edge_id : edges) {
+			weight = weight + graph_.GetEdge(edge_id).weight;
+		}
+
+		return RouteInfo{ weight, edges.size() };
 	}
 
 }
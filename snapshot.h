@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary snapshots store values in the native byte order of the machine that wrote them.
+namespace Snapshot {
+
+	static const char MAGIC[8] = { 'T', 'C', 'S', 'N', 'A', 'P', '\0', '\0' };
+	static const uint32_t VERSION = 4;
+
+	class Writer {
+	public:
+		explicit Writer(const std::string& path) : path_(path), out_(path, std::ios::binary) {
+			if (!out_) {
+				throw std::runtime_error("can't open snapshot for writing: " + path);
+			}
+			out_.write(MAGIC, sizeof(MAGIC));
+			Write(VERSION);
+		}
+
+		template <typename T>
+		void Write(const T& value) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			out_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		void WriteString(std::string_view str) {
+			Write(static_cast<uint64_t>(str.size()));
+			out_.write(str.data(), str.size());
+		}
+
+		template <typename T>
+		void WriteVector(const std::vector<T>& values) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			Write(static_cast<uint64_t>(values.size()));
+			out_.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+		}
+
+		// Closes the file and throws if any write failed, e.g. on a full disk,
+		// so that a truncated file is never reported as saved.
+		void Finish() {
+			out_.close();
+			if (!out_) {
+				throw std::runtime_error("can't write snapshot: " + path_);
+			}
+		}
+
+	private:
+		std::string path_;
+		std::ofstream out_;
+	};
+
+	// Read-only view of a whole file: memory-mapped where available, read into memory otherwise.
+	class MappedFile {
+	public:
+		explicit MappedFile(const std::string& path) {
+#ifndef _WIN32
+			const int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				throw std::runtime_error("can't open snapshot: " + path);
+			}
+			struct stat file_stat;
+			if (fstat(fd, &file_stat) != 0) {
+				close(fd);
+				throw std::runtime_error("can't stat snapshot: " + path);
+			}
+			size_ = file_stat.st_size;
+			if (size_ > 0) {
+				void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED) {
+					close(fd);
+					throw std::runtime_error("can't map snapshot: " + path);
+				}
+				data_ = static_cast<const char*>(data);
+			}
+			close(fd);
+#else
+			std::ifstream in(path, std::ios::binary);
+			if (!in) {
+				throw std::runtime_error("can't open snapshot: " + path);
+			}
+			buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			data_ = buffer_.data();
+			size_ = buffer_.size();
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+#ifndef _WIN32
+			if (data_) {
+				munmap(const_cast<char*>(data_), size_);
+			}
+#endif
+		}
+
+		std::string_view GetData() const {
+			return { data_, size_ };
+		}
+
+	private:
+		const char* data_ = nullptr;
+		size_t size_ = 0;
+#ifdef _WIN32
+		std::vector<char> buffer_;
+#endif
+	};
+
+	class Reader {
+	public:
+		explicit Reader(std::string_view data) : data_(data) {
+			if (data_.size() < sizeof(MAGIC) || std::memcmp(data_.data(), MAGIC, sizeof(MAGIC)) != 0) {
+				throw std::runtime_error("not a snapshot file");
+			}
+			data_.remove_prefix(sizeof(MAGIC));
+			if (Read<uint32_t>() != VERSION) {
+				throw std::runtime_error("unsupported snapshot version");
+			}
+		}
+
+		template <typename T>
+		T Read() {
+			static_assert(std::is_trivially_copyable_v<T>);
+			T value;
+			std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+			return value;
+		}
+
+		std::string_view ReadString() {
+			const size_t size = Read<uint64_t>();
+			return { Take(size), size };
+		}
+
+		template <typename T>
+		std::vector<T> ReadVector() {
+			static_assert(std::is_trivially_copyable_v<T>);
+			// The size is checked against the data left before anything is allocated for it.
+			const size_t size = Read<uint64_t>();
+			if (size > data_.size() / sizeof(T)) {
+				throw std::runtime_error("truncated snapshot");
+			}
+			const char* data = Take(size * sizeof(T));
+			std::vector<T> values(size);
+			std::memcpy(values.data(), data, size * sizeof(T));
+			return values;
+		}
+
+	private:
+		std::string_view data_;
+
+		const char* Take(size_t size) {
+			if (data_.size() < size) {
+				throw std::runtime_error("truncated snapshot");
+			}
+			const char* result = data_.data();
+			data_.remove_prefix(size);
+			return result;
+		}
+	};
+
+}
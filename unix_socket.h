@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cerrno>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Stream socket listening on a filesystem path; not available on Windows.
+namespace UnixSocket {
+
+#ifndef _WIN32
+	// Input buffer reading straight from a file descriptor, for std::istream over a connection.
+	class InputBuffer : public std::streambuf {
+	public:
+		explicit InputBuffer(int fd) : fd_(fd) {}
+
+	protected:
+		int_type underflow() override {
+			if (gptr() == egptr()) {
+				ssize_t size;
+				do {
+					size = read(fd_, buffer_, sizeof(buffer_));
+				} while (size < 0 && errno == EINTR);
+				if (size <= 0) {
+					return traits_type::eof();
+				}
+				setg(buffer_, buffer_, buffer_ + size);
+			}
+			return traits_type::to_int_type(*gptr());
+		}
+
+	private:
+		int fd_;
+		char buffer_[1 << 16];
+	};
+
+	// Writes all of data unless the peer has gone away.
+	inline bool WriteAll(int fd, std::string_view data) {
+		while (!data.empty()) {
+			const ssize_t size = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+			if (size < 0 && errno == EINTR) {
+				continue;
+			}
+			if (size <= 0) {
+				return false;
+			}
+			data.remove_prefix(size);
+		}
+		return true;
+	}
+
+	class Listener {
+	public:
+		explicit Listener(const std::string& path) : path_(path) {
+			sockaddr_un address{};
+			address.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(address.sun_path)) {
+				throw std::runtime_error("socket path is too long: " + path);
+			}
+			path.copy(address.sun_path, path.size());
+
+			fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd_ < 0) {
+				throw std::runtime_error("can't create socket");
+			}
+			unlink(path.c_str());
+			if (bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(fd_, SOMAXCONN) != 0) {
+				close(fd_);
+				throw std::runtime_error("can't listen on socket: " + path);
+			}
+		}
+
+		Listener(const Listener&) = delete;
+		Listener& operator=(const Listener&) = delete;
+
+		~Listener() {
+			close(fd_);
+			unlink(path_.c_str());
+		}
+
+		// Blocks until a client connects; returns the connection's descriptor or -1.
+		int Accept() {
+			int fd;
+			do {
+				fd = accept(fd_, nullptr, nullptr);
+			} while (fd < 0 && errno == EINTR);
+			return fd;
+		}
+
+	private:
+		std::string path_;
+		int fd_;
+	};
+#endif
+
+}